@@ -149,7 +149,7 @@ int read_image(const char* image_path)
 /* Check Key Windows */
 uint16_t check_key()
 {
-    return WaitForSingleObject(hStdin, 1000) == WAIT_OBJECT_0 && _kbhit();
+    return WaitForSingleObject(hStdin, 0) == WAIT_OBJECT_0 && _kbhit();
 }
 
 /* Memory Access */
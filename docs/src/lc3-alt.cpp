@@ -14,412 +14,1043 @@
 #include <sys/termios.h>
 #include <sys/mman.h>
 
+#include <sys/wait.h>
+#include "lc3-vm.h"
 
-/* Registers */
-enum
-{
-    R_R0 = 0,
-    R_R1,
-    R_R2,
-    R_R3,
-    R_R4,
-    R_R5,
-    R_R6,
-    R_R7,
-    R_PC, /* program counter */
-    R_COND,
-    R_COUNT
-};
+using namespace lc3;
 
-/* Condition Flags */
-enum
-{
-    FL_POS = 1 << 0, /* P */
-    FL_ZRO = 1 << 1, /* Z */
-    FL_NEG = 1 << 2, /* N */
-};
+/* Input Buffering */
+struct termios original_tio;
 
-/* Opcodes */
-enum
+void disable_input_buffering()
 {
-    OP_BR = 0, /* branch */
-    OP_ADD,    /* add  */
-    OP_LD,     /* load */
-    OP_ST,     /* store */
-    OP_JSR,    /* jump register */
-    OP_AND,    /* bitwise and */
-    OP_LDR,    /* load register */
-    OP_STR,    /* store register */
-    OP_RTI,    /* unused */
-    OP_NOT,    /* bitwise not */
-    OP_LDI,    /* load indirect */
-    OP_STI,    /* store indirect */
-    OP_JMP,    /* jump */
-    OP_RES,    /* reserved (unused) */
-    OP_LEA,    /* load effective address */
-    OP_TRAP    /* execute trap */
-};
-
+    tcgetattr(STDIN_FILENO, &original_tio);
+    struct termios new_tio = original_tio;
+    new_tio.c_lflag &= ~ICANON & ~ECHO;
+    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+}
 
-/* Memory Mapped Registers */
-enum
+void restore_input_buffering()
 {
-    MR_KBSR = 0xFE00, /* keyboard status */
-    MR_KBDR = 0xFE02  /* keyboard data */
-};
+    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+}
 
-/* TRAP Codes */
-enum
+/* Handle Interrupt C++ */
+void handle_interrupt(int signal)
 {
-    TRAP_GETC = 0x20,  /* get character from keyboard, not echoed onto the terminal */
-    TRAP_OUT = 0x21,   /* output a character */
-    TRAP_PUTS = 0x22,  /* output a word string */
-    TRAP_IN = 0x23,    /* get character from keyboard, echoed onto the terminal */
-    TRAP_PUTSP = 0x24, /* output a byte string */
-    TRAP_HALT = 0x25   /* halt the program */
-};
+    /* best effort, the VM may be in the middle of an append */
+    output_state& out = output();
+    if (write(STDOUT_FILENO, out.data, out.size) < 0) {}
+    restore_input_buffering();
+    printf("\n");
+    exit(-2);
+}
 
 
-/* Memory Storage */
-/* 65536 locations */
-uint16_t memory[UINT16_MAX];
+/* a guest stopped by --max-cycles or --timeout, so scripts can tell it from
+   one that failed to load (1) or a bad command line (2) */
+enum { EXIT_BUDGET = 3, EXIT_TIMEOUT = 4, EXIT_FAULT = 5 };
 
-/* Register Storage */
-uint16_t reg[R_COUNT];
+/* Metrics Dump */
+/* --metrics: while a batch runs, the counters of its guests are written
+   to a file every interval and once more at the end. the file is replaced
+   whole, so a reader never sees half of one. a path ending in .prom gets
+   the Prometheus text format, for a node exporter textfile collector to
+   serve, anything else JSON */
+struct metrics_options
+{
+    const char* path = NULL;
+    std::chrono::milliseconds every{1000};
+};
 
+/* 0 if the file could not be written */
+int write_metrics(const char* path, const std::vector<std::string>& names, const std::vector<batch_job>& jobs,
+                  std::vector<metrics_sample>& before, double seconds)
+{
+    std::vector<metrics_sample> now;
+    for (const batch_job& job : jobs) { now.emplace_back(job.metrics); }
+    size_t len = strlen(path);
+    std::string text = len >= 5 && strcmp(path + len - 5, ".prom") == 0
+        ? metrics_prometheus(names, now, before, seconds) : metrics_json(names, now, before, seconds);
+    before.swap(now);
+    std::string tmp = std::string(path) + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f) { return 0; }
+    bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+    ok = fclose(f) == 0 && ok;
+    return ok && rename(tmp.c_str(), path) == 0;
+}
 
-/* Sign Extend */
-uint16_t sign_extend(uint16_t x, int bit_count)
+/* runs the batch with a thread writing its metrics alongside */
+void run_metered(std::vector<batch_job>& jobs, const std::vector<std::string>& names,
+                 const batch_options& opt, const metrics_options& metrics)
 {
-    if ((x >> (bit_count - 1)) & 1) {
-        x |= (0xFFFF << bit_count);
+    std::mutex lock;
+    std::condition_variable finished;
+    bool done = false;
+    bool ok = true;
+    std::thread writer([&]
+    {
+        std::vector<metrics_sample> before(jobs.size());
+        auto last = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> guard(lock);
+        for (bool end = false; !end;)
+        {
+            end = finished.wait_for(guard, metrics.every, [&] { return done; });
+            auto now = std::chrono::steady_clock::now();
+            double seconds = std::chrono::duration<double>(now - last).count();
+            ok = write_metrics(metrics.path, names, jobs, before, seconds) && ok;
+            last = now;
+        }
+    });
+    run_batch(jobs, opt);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        done = true;
     }
-    return x;
+    finished.notify_one();
+    writer.join();
+    if (!ok) { fprintf(stderr, "failed to write metrics: %s\n", metrics.path); }
 }
 
-/* Swap */
-uint16_t swap16(uint16_t x)
+/* Batch Manifest */
+std::string read_stream(FILE* f)
 {
-    return (x << 8) | (x >> 8);
+    std::string data;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) { data.append(buf, n); }
+    return data;
 }
 
-/* Update Flags */
-void update_flags(uint16_t r)
+/* the whole file, or an empty string if it cannot be read */
+std::string read_file(const char* path, int* ok)
 {
-    if (reg[r] == 0)
+    FILE* f = fopen(path, "rb");
+    *ok = f != NULL;
+    if (!f) { return std::string(); }
+    std::string data = read_stream(f);
+    fclose(f);
+    return data;
+}
+
+/* one job per line: the images to load, .asm sources among them, then
+   optionally "< input" and "> output" like a shell would take them.
+   output without a file goes to stdout in manifest order. blank lines and
+   lines starting with # are skipped. exits 0 if every guest halted, and
+   with the status of a single run that was stopped if one was. in the
+   metrics a guest goes by its line and last image */
+int run_manifest(const char* path, const batch_options& opt, const metrics_options& metrics)
+{
+    int ok;
+    std::string text = read_file(path, &ok);
+    if (!ok)
     {
-        reg[R_COND] = FL_ZRO;
+        printf("failed to read manifest: %s\n", path);
+        return 1;
     }
-    else if (reg[r] >> 15) /* a 1 in the left-most bit indicates negative */
+
+    std::vector<batch_job> jobs;
+    std::vector<std::string> outputs;
+    std::vector<std::string> names;
+    size_t line_start = 0;
+    for (int line = 1; line_start < text.size(); ++line)
     {
-        reg[R_COND] = FL_NEG;
+        size_t line_end = text.find('\n', line_start);
+        if (line_end == std::string::npos) { line_end = text.size(); }
+        std::vector<std::string> words;
+        for (size_t i = line_start; i < line_end;)
+        {
+            while (i < line_end && isspace((unsigned char)text[i])) { ++i; }
+            size_t w = i;
+            while (i < line_end && !isspace((unsigned char)text[i])) { ++i; }
+            if (i > w) { words.push_back(text.substr(w, i - w)); }
+        }
+        line_start = line_end + 1;
+        if (words.empty() || words[0][0] == '#') { continue; }
+
+        jobs.emplace_back();
+        outputs.emplace_back();
+        batch_job& job = jobs.back();
+        for (size_t i = 0; i < words.size(); ++i)
+        {
+            if ((words[i] == "<" || words[i] == ">") && i + 1 < words.size())
+            {
+                if (words[i] == ">")
+                {
+                    outputs.back() = words[++i];
+                    continue;
+                }
+                job.io.in = read_file(words[++i].c_str(), &ok);
+                if (!ok)
+                {
+                    printf("%s:%d: failed to read input: %s\n", path, line, words[i].c_str());
+                    return 1;
+                }
+            }
+            else
+            {
+                job.images.push_back(words[i]);
+            }
+        }
+        if (job.images.empty())
+        {
+            printf("%s:%d: no image\n", path, line);
+            return 1;
+        }
+        names.push_back(std::to_string(line) + ":" + job.images.back());
     }
-    else
+
+    if (metrics.path) { run_metered(jobs, names, opt, metrics); }
+    else { run_batch(jobs, opt); }
+
+    size_t count[BATCH_FAILED + 1] = {};
+    for (size_t i = 0; i < jobs.size(); ++i)
     {
-        reg[R_COND] = FL_POS;
+        batch_job& job = jobs[i];
+        ++count[job.status];
+        if (job.status == BATCH_FAILED)
+        {
+            fprintf(stderr, "%s\n", job.error.c_str());
+            continue;
+        }
+        if (job.status == BATCH_LIMIT || job.status == BATCH_TIMEOUT)
+        {
+            fprintf(stderr, "%s: %s after %llu instructions, PC=x%04X\n", job.images.back().c_str(),
+                    job.status == BATCH_TIMEOUT ? "timed out"
+                    : job.io.full ? "hit the output limit" : "hit the cycle limit",
+                    (unsigned long long)job.cycles, job.pc);
+        }
+        const std::string& out = job.io.out;
+        if (outputs[i].empty())
+        {
+            fwrite(out.data(), 1, out.size(), stdout);
+            continue;
+        }
+        FILE* f = fopen(outputs[i].c_str(), "wb");
+        if (!f || fwrite(out.data(), 1, out.size(), f) != out.size())
+        {
+            fprintf(stderr, "failed to write output: %s\n", outputs[i].c_str());
+            --count[job.status];
+            ++count[BATCH_FAILED];
+        }
+        if (f) { fclose(f); }
     }
+    fprintf(stderr, "batch: %zu jobs, %zu halted, %zu hit the cycle or output limit, %zu timed out, %zu failed\n",
+            jobs.size(), count[BATCH_HALTED], count[BATCH_LIMIT], count[BATCH_TIMEOUT], count[BATCH_FAILED]);
+    if (count[BATCH_FAILED]) { return 1; }
+    if (count[BATCH_TIMEOUT]) { return EXIT_TIMEOUT; }
+    return count[BATCH_LIMIT] ? EXIT_BUDGET : 0;
 }
 
-/* Read Image File */
-void read_image_file(FILE* file)
+/* Bench */
+/* small guests that each lean on one part of the VM, and two real ones fed
+   the same keys every run */
+/* tight ADD/BR loop, 10000 x 1000 */
+const uint16_t bench_add_br[] = {
+    0x2207, /* LD R1, OUTER */
+    0x2407, /* L1: LD R2, INNER */
+    0x1021, /* L2: ADD R0, R0, #1 */
+    0x14BF, /* ADD R2, R2, #-1 */
+    0x03FD, /* BRp L2 */
+    0x127F, /* ADD R1, R1, #-1 */
+    0x03FA, /* BRp L1 */
+    0xF025, /* HALT */
+    0x03E8, /* OUTER: .FILL #1000 */
+    0x2710, /* INNER: .FILL #10000 */
+};
+
+/* LDR/STR copy of 256 words, 20000 times */
+const uint16_t bench_memcpy[] = {
+    0x2A0C, /* LD R5, TIMES */
+    0x220D, /* L1: LD R1, SRC */
+    0x240D, /* LD R2, DST */
+    0x280A, /* LD R4, WORDS */
+    0x6640, /* L2: LDR R3, R1, #0 */
+    0x7680, /* STR R3, R2, #0 */
+    0x1261, /* ADD R1, R1, #1 */
+    0x14A1, /* ADD R2, R2, #1 */
+    0x193F, /* ADD R4, R4, #-1 */
+    0x03FA, /* BRp L2 */
+    0x1B7F, /* ADD R5, R5, #-1 */
+    0x03F5, /* BRp L1 */
+    0xF025, /* HALT */
+    0x4E20, /* TIMES: .FILL #20000 */
+    0x0100, /* WORDS: .FILL #256 */
+    0x4000, /* SRC: .FILL x4000 */
+    0x5000, /* DST: .FILL x5000 */
+};
+
+/* LDI through a 4096 node ring, 5000000 hops */
+const uint16_t bench_chase[] = {
+    0x5260, /* AND R1, R1, #0 */
+    0x2415, /* LD R2, BASE */
+    0x2615, /* LD R3, MASK */
+    0x2815, /* LD R4, STRIDE */
+    0x2A15, /* LD R5, NODES */
+    0x1C44, /* INIT: ADD R6, R1, R4 */
+    0x5D83, /* AND R6, R6, R3 */
+    0x1D82, /* ADD R6, R6, R2 */
+    0x1E42, /* ADD R7, R1, R2 */
+    0x7DC0, /* STR R6, R7, #0 */
+    0x1261, /* ADD R1, R1, #1 */
+    0x1B7F, /* ADD R5, R5, #-1 */
+    0x03F8, /* BRp INIT */
+    0x340F, /* ST R2, CUR */
+    0x220C, /* LD R1, OUTER */
+    0x2A0C, /* L1: LD R5, INNER */
+    0xA00C, /* L2: LDI R0, CUR */
+    0x300B, /* ST R0, CUR */
+    0x1B7F, /* ADD R5, R5, #-1 */
+    0x03FC, /* BRp L2 */
+    0x127F, /* ADD R1, R1, #-1 */
+    0x03F9, /* BRp L1 */
+    0xF025, /* HALT */
+    0x4000, /* BASE: .FILL x4000 */
+    0x0FFF, /* MASK: .FILL x0FFF */
+    0x03FD, /* STRIDE: .FILL #1021 */
+    0x1000, /* NODES: .FILL #4096 */
+    0x01F4, /* OUTER: .FILL #500 */
+    0x2710, /* INNER: .FILL #10000 */
+    0x0000, /* CUR: .FILL #0 */
+};
+
+/* TRAP OUT, 200000 characters */
+const uint16_t bench_trap_out[] = {
+    0x220B, /* LD R1, OUTER */
+    0x240B, /* L1: LD R2, INNER */
+    0x200B, /* LD R0, CHAR */
+    0xF021, /* L2: OUT */
+    0x14BF, /* ADD R2, R2, #-1 */
+    0x03FD, /* BRp L2 */
+    0x5020, /* AND R0, R0, #0 */
+    0x102A, /* ADD R0, R0, #10 */
+    0xF021, /* OUT */
+    0x127F, /* ADD R1, R1, #-1 */
+    0x03F6, /* BRp L1 */
+    0xF025, /* HALT */
+    0x03E8, /* OUTER: .FILL #1000 */
+    0x00C8, /* INNER: .FILL #200 */
+    0x002A, /* CHAR: .FILL x2A */
+};
+
+struct bench_kernel
 {
-    /* the origin tells us where in memory to place the image */
-    uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file);
-    origin = swap16(origin);
+    const char* name;
+    const uint16_t* words; /* loaded at PC_START */
+    size_t count;
+    const char* image;     /* or an image from the supplies */
+    const char* input;     /* typed ahead, then EOF */
+    uint64_t budget;       /* instructions, for guests that never halt */
+};
 
-    /* we know the maximum file size so we only need one fread */
-    uint16_t max_read = UINT16_MAX - origin;
-    uint16_t* p = memory + origin;
-    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+#define BENCH_WORDS(a) a, sizeof(a) / sizeof(a[0]), NULL
 
-    /* swap to little endian */
-    while (read-- > 0)
-    {
-        *p = swap16(*p);
-        ++p;
-    }
-}
+const bench_kernel bench_kernels[] = {
+    { "add-br", BENCH_WORDS(bench_add_br), "", 0 },
+    { "memcpy", BENCH_WORDS(bench_memcpy), "", 0 },
+    { "ldi-chase", BENCH_WORDS(bench_chase), "", 0 },
+    { "trap-out", BENCH_WORDS(bench_trap_out), "", 0 },
+    { "rogue", NULL, 0, "rogue.obj", "xwasdwwaassddwasdwasdsssaaawwwdddsssssdddddsdsdsdsdsd", 20000000 },
+    { "2048", NULL, 0, "2048.obj", "ywasdwwaassddwasdwasdsssaaawwwddd", 20000000 },
+};
 
-/* Read Image */
-int read_image(const char* image_path)
+/* keys come from a script, output goes through the console buffer so
+   its write() calls are counted like a terminal run */
+struct bench_io : vm_io
 {
-    FILE* file = fopen(image_path, "rb");
-    if (!file) { return 0; };
-    read_image_file(file);
-    fclose(file);
-    return 1;
-}
+    const char* in = "";
+
+    bool ready() override { return true; }
+    int getc() override { return *in ? (uint8_t)*in++ : EOF; }
+    void put(const char* s, size_t n) override { output_put(s, n); }
+    void flush() override { output_flush(); }
+};
+
+enum { BENCH_INTERPRETER, BENCH_JIT, BENCH_WIDE };
 
-/* Check Key */
-uint16_t check_key()
+struct bench_result
 {
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(STDIN_FILENO, &readfds);
-
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    return select(1, &readfds, NULL, NULL, &timeout) != 0;
+    bool ok;
+    uint64_t instructions;
+    double seconds;
+    uint64_t writes;      /* write() calls for output */
+};
+
+int bench_load(Vm& vm, const bench_kernel& k, const char* supplies)
+{
+    if (k.words)
+    {
+        memcpy(vm.memory + PC_START, k.words, k.count * sizeof(uint16_t));
+        return 1;
+    }
+    std::string path = std::string(supplies) + "/" + k.image;
+    return vm.load_image(path.c_str());
 }
 
-/* Memory Access */
-void mem_write(uint16_t address, uint16_t val)
+double bench_seconds(std::chrono::steady_clock::time_point start)
 {
-    memory[address] = val;
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 }
 
-uint16_t mem_read(uint16_t address)
+bench_result bench_engine(const bench_kernel& k, const char* supplies, int engine)
 {
-    if (address == MR_KBSR)
+    bench_result r = {};
+    Vm vm;
+    bench_io io;
+    io.in = k.input;
+    vm.io = &io;
+    if (!bench_load(vm, k, supplies)) { return r; }
+    if (engine == BENCH_JIT && !vm.enable_jit()) { return r; }
+
+    uint64_t writes = output().writes.load();
+    auto start = std::chrono::steady_clock::now();
+    if (engine == BENCH_WIDE)
     {
-        if (check_key())
+#if LC3_WIDE
+        /* every lane types the same keys */
+        std::unique_ptr<wide_vm> w(new wide_vm);
+        bench_io lanes[WIDE_LANES];
+        w->load(vm, WIDE_LANES);
+        for (int i = 0; i < WIDE_LANES; ++i)
         {
-            memory[MR_KBSR] = (1 << 15);
-            memory[MR_KBDR] = getchar();
+            lanes[i].in = k.input;
+            w->io[i] = &lanes[i];
         }
-        else
+        w->run(k.budget ? k.budget : UINT64_MAX);
+        for (int i = 0; i < WIDE_LANES; ++i) { r.instructions += w->cycles[i]; }
+#else
+        return r;
+#endif
+    }
+    else
+    {
+        vm.run_until(k.budget ? k.budget : UINT64_MAX);
+        r.instructions = vm.cpu.cycles;
+    }
+    output_flush();
+    r.seconds = bench_seconds(start);
+    r.writes = output().writes.load() - writes;
+    r.ok = true;
+    return r;
+}
+
+/* another VM binary as a child, e.g. the switch engine in lc3.c. such a
+   binary counts nothing, so it only gets kernels that halt and the count
+   comes from our own run. write() calls are read from /proc while the
+   child is a zombie */
+bench_result bench_exec(const char* binary, const bench_kernel& k, const char* supplies,
+                        const char* dir, uint64_t instructions)
+{
+    bench_result r = {};
+    std::string image = k.image ? std::string(supplies) + "/" + k.image : std::string(dir) + "/" + k.name + ".obj";
+    std::string keys = std::string(dir) + "/" + k.name + ".in";
+    if (k.words)
+    {
+        std::vector<uint16_t> obj(k.count + 1);
+        obj[0] = swap16(PC_START);
+        for (size_t i = 0; i < k.count; ++i) { obj[i + 1] = swap16(k.words[i]); }
+        FILE* f = fopen(image.c_str(), "wb");
+        if (!f) { return r; }
+        fwrite(obj.data(), sizeof(uint16_t), obj.size(), f);
+        fclose(f);
+    }
+    FILE* f = fopen(keys.c_str(), "wb");
+    if (!f) { return r; }
+    fputs(k.input, f);
+    fclose(f);
+
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int in = open(keys.c_str(), O_RDONLY);
+        int out = open("/dev/null", O_WRONLY);
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        execl(binary, binary, image.c_str(), (char*)NULL);
+        _exit(127);
+    }
+    if (pid < 0) { return r; }
+
+    siginfo_t info = {};
+    waitid(P_PID, pid, &info, WEXITED | WNOWAIT);
+    r.seconds = bench_seconds(start);
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    if (FILE* io = fopen(path, "r"))
+    {
+        char line[128];
+        while (fgets(line, sizeof(line), io))
         {
-            memory[MR_KBSR] = 0;
+            unsigned long long n;
+            if (sscanf(line, "syscw: %llu", &n) == 1) { r.writes = n; }
         }
+        fclose(io);
     }
-    return memory[address];
+    waitpid(pid, NULL, 0);
+    r.instructions = instructions;
+    r.ok = info.si_code == CLD_EXITED && info.si_status == 0;
+    return r;
 }
 
-/* Input Buffering */
-struct termios original_tio;
-
-void disable_input_buffering()
+void bench_print(const char* kernel, const char* engine, const bench_result& r)
 {
-    tcgetattr(STDIN_FILENO, &original_tio);
-    struct termios new_tio = original_tio;
-    new_tio.c_lflag &= ~ICANON & ~ECHO;
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+    if (!r.ok)
+    {
+        printf("%-10s %-16s %14s\n", kernel, engine, "unavailable");
+        return;
+    }
+    double mips = r.instructions / r.seconds / 1e6;
+    printf("%-10s %-16s %14llu %9.3f %9.1f %9.2f %8llu\n", kernel, engine,
+           (unsigned long long)r.instructions, r.seconds, mips, 1e3 / mips,
+           (unsigned long long)r.writes);
+    fflush(stdout);
 }
 
-void restore_input_buffering()
+/* runs every kernel on every engine built in, and on each binary given */
+int run_bench(const char* supplies, const std::vector<const char*>& binaries)
 {
-    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    char dir[] = "/tmp/lc3-bench-XXXXXX";
+    if (!mkdtemp(dir))
+    {
+        printf("failed to create a directory for the kernels\n");
+        return 1;
+    }
+    output().fd = open("/dev/null", O_WRONLY);
+    output_start();
+
+    const char* interpreter = LC3_THREADED ? "threaded" : "op-table";
+    char wide[32];
+#if LC3_WIDE
+    snprintf(wide, sizeof(wide), "wide x%d", (int)WIDE_LANES);
+#else
+    snprintf(wide, sizeof(wide), "wide");
+#endif
+    printf("%-10s %-16s %14s %9s %9s %9s %8s\n",
+           "kernel", "engine", "instructions", "seconds", "MIPS", "ns/instr", "writes");
+    for (const bench_kernel& k : bench_kernels)
+    {
+        bench_result base = bench_engine(k, supplies, BENCH_INTERPRETER);
+        bench_print(k.name, interpreter, base);
+        if (!base.ok) { continue; }
+        bench_print(k.name, "jit", bench_engine(k, supplies, BENCH_JIT));
+        bench_print(k.name, wide, bench_engine(k, supplies, BENCH_WIDE));
+        if (k.budget) { continue; }
+        for (const char* binary : binaries)
+        {
+            bench_print(k.name, binary, bench_exec(binary, k, supplies, dir, base.instructions));
+        }
+    }
+
+    for (const bench_kernel& k : bench_kernels)
+    {
+        unlink((std::string(dir) + "/" + k.name + ".obj").c_str());
+        unlink((std::string(dir) + "/" + k.name + ".in").c_str());
+    }
+    rmdir(dir);
+    return 0;
 }
 
-/* Handle Interrupt */
-void handle_interrupt(int signal)
+/* Replay */
+int run_replay(const char* path, unsigned threads)
 {
-    restore_input_buffering();
-    printf("\n");
-    exit(-2);
+    trace_replay_report report;
+    auto start = std::chrono::steady_clock::now();
+    if (!trace_replay(path, threads, report))
+    {
+        fprintf(stderr, "%s\n", report.error.c_str());
+        return 1;
+    }
+    std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+    int failed = 0;
+    for (const trace_segment& seg : report.segments)
+    {
+        if (seg.error.empty()) { continue; }
+        printf("segment from %llu: %s\n", (unsigned long long)seg.first, seg.error.c_str());
+        ++failed;
+    }
+    printf("replay: %zu segments, %d failed, %llu records verified on %u threads in %.3f s\n",
+           report.segments.size(), failed, (unsigned long long)report.verified, report.threads, took.count());
+    return failed ? 1 : 0;
 }
 
+/* Fuzz Driver */
+/* a small coverage guided loop around fuzz_one for when libFuzzer is not
+   at hand, see lc3-fuzz.cpp. an input that reaches an edge class no
+   earlier one did joins the corpus, and every run after the seed mutates
+   a corpus entry picked at random. each fault and hang is reported once
+   per address, and saved to the directory given */
+struct fuzz_options
+{
+    uint64_t runs = 0;
+    uint64_t budget = 0;      /* instructions per input, 0 for FUZZ_BUDGET */
+    uint64_t seed = 1;
+    const char* input = NULL; /* the first input, or none */
+    const char* out = NULL;
+};
 
-int running = 1;
-/* Instruction C++ */
-template <unsigned op>
-void ins(uint16_t instr)
+void fuzz_save(const char* dir, const char* kind, uint16_t pc, const std::vector<uint8_t>& in)
 {
-    uint16_t r0, r1, r2, imm5, imm_flag;
-    uint16_t pc_plus_off, base_plus_off;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s-x%04X", dir, kind, pc);
+    FILE* f = fopen(path, "wb");
+    if (!f || fwrite(in.data(), 1, in.size(), f) != in.size()) { fprintf(stderr, "failed to write %s\n", path); }
+    if (f) { fclose(f); }
+}
 
-    constexpr uint16_t opbit = (1 << op);
-    if (0x4EEE & opbit) { r0 = (instr >> 9) & 0x7; }
-    if (0x12F3 & opbit) { r1 = (instr >> 6) & 0x7; }
-    if (0x0022 & opbit)
+int run_fuzz(Vm& vm, const fuzz_options& opt)
+{
+    std::unique_ptr<fuzz_target> t(new fuzz_target);
+    if (!fuzz_open(*t, vm))
+    {
+        fprintf(stderr, "failed to freeze the machine for fuzzing\n");
+        return 1;
+    }
+    if (opt.budget) { t->budget = opt.budget; }
+    std::vector<std::vector<uint8_t>> corpus(1);
+    if (opt.input)
     {
-        imm_flag = (instr >> 5) & 0x1;
+        int ok;
+        std::string seed = read_file(opt.input, &ok);
+        if (!ok)
+        {
+            fprintf(stderr, "failed to read input: %s\n", opt.input);
+            return 1;
+        }
+        corpus[0].assign(seed.begin(), seed.end());
+    }
+
+    std::vector<uint8_t> seen(FUZZ_MAP);
+    std::vector<uint32_t> reported;
+    uint64_t rng = opt.seed ? opt.seed : 1;
+    unsigned faults = 0, hangs = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t run = 0; run < opt.runs; ++run)
+    {
+        std::vector<uint8_t> in = corpus[fuzz_random(rng) % corpus.size()];
+        if (run) { fuzz_mutate(in, rng); }
+        int r = fuzz_one(*t, in.data(), in.size());
+        if (fuzz_merge(t->map, seen.data())) { corpus.push_back(in); }
+        memset(t->map, 0, sizeof(t->map));
+        if (r == FUZZ_DONE) { continue; }
 
-        if (imm_flag)
+        uint16_t pc = r == FUZZ_FAULT ? t->state.fault_pc : t->vm->cpu.reg[R_PC];
+        uint32_t key = (uint32_t)r << 24 | (uint32_t)(r == FUZZ_FAULT ? t->state.fault : 0) << 16 | pc;
+        if (std::find(reported.begin(), reported.end(), key) != reported.end()) { continue; }
+        reported.push_back(key);
+        const char* kind = r == FUZZ_HANG ? "hang" : t->state.fault == INT_ILLEGAL ? "illegal" : "privilege";
+        if (r == FUZZ_FAULT)
         {
-            imm5 = sign_extend(instr & 0x1F, 5);
+            ++faults;
+            fprintf(stderr, "fault: %s at x%04X after %zu of %zu input bytes\n",
+                    t->state.fault == INT_ILLEGAL ? "reserved opcode" : "RTI in user mode", pc, t->io.pos, in.size());
         }
         else
         {
-            r2 = instr & 0x7;
+            ++hangs;
+            fprintf(stderr, "hang: still running at x%04X after %llu instructions\n", pc, (unsigned long long)t->budget);
         }
+        if (opt.out) { fuzz_save(opt.out, kind, pc, in); }
     }
-    if (0x00C0 & opbit)
-    {   // Base + offset
-        base_plus_off = reg[r1] + sign_extend(instr & 0x3F, 6);
+    double took = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t edges = FUZZ_MAP - std::count(seen.begin(), seen.end(), 0);
+    fprintf(stderr, "fuzz: %llu runs in %.3f s, %.0f/s, %zu edges, %zu inputs in the corpus, %u faults, %u hangs\n",
+            (unsigned long long)opt.runs, took, took > 0 ? opt.runs / took : 0.0, edges, corpus.size(), faults, hangs);
+    return faults ? EXIT_FAULT : 0;
+}
+
+
+int main(int argc, const char* argv[])
+{
+    Vm vm;
+    int status = 0;
+    /* Load Arguments C++ */
+    int use_jit = 0;
+    std::vector<std::string> images;
+    bool allow_overlap = false;
+    bool display = false;
+    const char* manifest = NULL;
+    batch_options batch;
+    bool bench = false;
+    const char* supplies = "../supplies";
+    std::vector<const char*> bench_binaries;
+    const char* profile_path = NULL;
+    const char* snapshot_path = NULL;
+    uint64_t snapshot_at = 0;
+    bool headless = false;
+    const char* input_path = NULL;
+    const char* output_path = NULL;
+    const char* trace_path = NULL;
+    uint64_t trace_every = TRACE_INTERVAL;
+    const char* replay_path = NULL;
+    int gdb_port = 0;
+    bool analyze = false;
+    fuzz_options fuzz;
+    metrics_options metrics;
+    for (int j = 1; j < argc; ++j)
+    {
+        if (strcmp(argv[j], "--jit") == 0)
+        {
+            use_jit = 1;
+        }
+        else if (strcmp(argv[j], "--headless") == 0)
+        {
+            headless = true;
+        }
+        else if (strcmp(argv[j], "--input") == 0 && j + 1 < argc)
+        {
+            headless = true;
+            input_path = argv[++j];
+        }
+        else if (strcmp(argv[j], "--output") == 0 && j + 1 < argc)
+        {
+            headless = true;
+            output_path = argv[++j];
+        }
+        else if (strcmp(argv[j], "--os") == 0)
+        {
+            vm.boot_os();
+        }
+        else if (strcmp(argv[j], "--profile") == 0 && j + 1 < argc)
+        {
+            profile_path = argv[++j];
+        }
+        else if (strcmp(argv[j], "--snapshot-at") == 0 && j + 2 < argc)
+        {
+            snapshot_at = strtoull(argv[j + 1], NULL, 10);
+            snapshot_path = argv[j + 2];
+            j += 2;
+        }
+        else if (strcmp(argv[j], "--batch") == 0 && j + 1 < argc)
+        {
+            manifest = argv[++j];
+        }
+        else if (strcmp(argv[j], "--bench") == 0)
+        {
+            bench = true;
+        }
+        else if (strcmp(argv[j], "--bench-exec") == 0 && j + 1 < argc)
+        {
+            bench_binaries.push_back(argv[++j]);
+        }
+        else if (strcmp(argv[j], "--bench-supplies") == 0 && j + 1 < argc)
+        {
+            supplies = argv[++j];
+        }
+        else if (strcmp(argv[j], "--wide") == 0)
+        {
+            batch.wide = true;
+        }
+        else if (strcmp(argv[j], "--threads") == 0 && j + 1 < argc)
+        {
+            batch.threads = atoi(argv[++j]);
+        }
+        else if (strcmp(argv[j], "--quantum") == 0 && j + 1 < argc)
+        {
+            long long n = atoll(argv[++j]);
+            batch.quantum = n < 1 ? 1 : n;
+        }
+        else if (strcmp(argv[j], "--max-cycles") == 0 && j + 1 < argc)
+        {
+            batch.max_cycles = strtoull(argv[++j], NULL, 10);
+        }
+        else if (strcmp(argv[j], "--timeout") == 0 && j + 1 < argc)
+        {
+            batch.timeout = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::duration<double>(atof(argv[++j])));
+        }
+        else if (strcmp(argv[j], "--max-output") == 0 && j + 1 < argc)
+        {
+            batch.max_output = strtoull(argv[++j], NULL, 10);
+        }
+        else if (strcmp(argv[j], "--decode-pages") == 0 && j + 1 < argc)
+        {
+            batch.decode_pages = strtoul(argv[++j], NULL, 10);
+            vm.decode_limit(batch.decode_pages);
+        }
+        else if (strcmp(argv[j], "--convert") == 0 && j + 2 < argc)
+        {
+            std::string error;
+            if (asm_source(argv[j + 1]) ? !convert_source(argv[j + 1], argv[j + 2], error)
+                                        : !convert_image(argv[j + 1], argv[j + 2]))
+            {
+                printf("failed to convert image: %s%s%s\n", argv[j + 1], error.empty() ? "" : ": ", error.c_str());
+                exit(1);
+            }
+            exit(0);
+        }
+        else if (strcmp(argv[j], "--flush-bytes") == 0 && j + 1 < argc)
+        {
+            long n = atol(argv[++j]);
+            output().limit = n < 1 ? 1 : n > OUTPUT_BUFFER_SIZE ? OUTPUT_BUFFER_SIZE : n;
+        }
+        else if (strcmp(argv[j], "--flush-ms") == 0 && j + 1 < argc)
+        {
+            output().delay = std::chrono::milliseconds(atol(argv[++j]));
+        }
+        else if (strcmp(argv[j], "--display") == 0)
+        {
+            display = true;
+        }
+        else if (strcmp(argv[j], "--idle") == 0)
+        {
+            vm.idle = true;
+        }
+        else if (strcmp(argv[j], "--trace") == 0 && j + 1 < argc)
+        {
+            trace_path = argv[++j];
+        }
+        else if (strcmp(argv[j], "--trace-every") == 0 && j + 1 < argc)
+        {
+            trace_every = strtoull(argv[++j], NULL, 10);
+        }
+        else if (strcmp(argv[j], "--replay") == 0 && j + 1 < argc)
+        {
+            replay_path = argv[++j];
+        }
+        else if (strcmp(argv[j], "--analyze") == 0)
+        {
+            analyze = true;
+        }
+        else if (strcmp(argv[j], "--gdb") == 0 && j + 1 < argc)
+        {
+            gdb_port = atoi(argv[++j]);
+        }
+        else if (strcmp(argv[j], "--fuzz") == 0 && j + 1 < argc)
+        {
+            fuzz.runs = strtoull(argv[++j], NULL, 10);
+        }
+        else if (strcmp(argv[j], "--fuzz-out") == 0 && j + 1 < argc)
+        {
+            fuzz.out = argv[++j];
+        }
+        else if (strcmp(argv[j], "--metrics") == 0 && j + 1 < argc)
+        {
+            metrics.path = argv[++j];
+        }
+        else if (strcmp(argv[j], "--metrics-every") == 0 && j + 1 < argc)
+        {
+            auto every = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::duration<double>(atof(argv[++j])));
+            metrics.every = std::max(every, std::chrono::milliseconds(1));
+        }
+        else if (strcmp(argv[j], "--fuzz-seed") == 0 && j + 1 < argc)
+        {
+            fuzz.seed = strtoull(argv[++j], NULL, 10);
+        }
+        else if (strcmp(argv[j], "--allow-overlap") == 0)
+        {
+            allow_overlap = true;
+            batch.allow_overlap = true;
+        }
+        else
+        {
+            images.push_back(argv[j]);
+        }
+    }
+    if (bench)
+    {
+        exit(run_bench(supplies, bench_binaries));
     }
-    if (0x4C0D & opbit)
+    if (replay_path)
     {
-        // Indirect address
-        pc_plus_off = reg[R_PC] + sign_extend(instr & 0x1FF, 9);
+        exit(run_replay(replay_path, batch.threads));
     }
-    if (0x0001 & opbit)
+    if (manifest)
     {
-        // BR
-        uint16_t cond = (instr >> 9) & 0x7;
-        if (cond & reg[R_COND]) { reg[R_PC] = pc_plus_off; }
+        batch.jit = use_jit;
+        batch.metrics = metrics.path != NULL;
+        exit(run_manifest(manifest, batch, metrics));
     }
-    if (0x0002 & opbit)  // ADD
+    if (images.empty())
     {
-        if (imm_flag)
+        /* show usage string */
+        printf("lc3 [--jit | --profile folded-stacks] [--os] [--max-cycles n] [--timeout seconds]\n"
+               "    [--decode-pages n] [--flush-bytes n] [--flush-ms n] [--allow-overlap] [--display]\n"
+               "    [--idle] [--analyze] [--trace file [--trace-every n]] [image-file1] ...\n");
+        printf("lc3 [--jit | --wide] [--threads n] [--quantum n] [--max-cycles n] [--timeout seconds]\n"
+               "    [--decode-pages n] [--max-output bytes] [--allow-overlap]\n"
+               "    [--metrics file [--metrics-every seconds]] --batch [manifest]\n");
+        printf("lc3 --headless [--input file] [--output file] [image-file1] ...\n");
+        printf("lc3 --convert [image.obj | source.asm] [native-image]\n");
+        printf("lc3 --snapshot-at [instructions] [snapshot] [image-file1] ...\n");
+        printf("lc3 --bench [--bench-supplies dir] [--bench-exec binary] ...\n");
+        printf("lc3 --replay trace [--threads n]\n");
+        printf("lc3 --gdb port [--os] [--idle] [image-file1] ...\n");
+        printf("lc3 --fuzz runs [--fuzz-out dir] [--fuzz-seed n] [--input seed] [--max-cycles n] [--os]\n"
+               "    [image-file1] ...\n");
+        exit(2);
+    }
+    
+    if (display)
+    {
+        vm.enable_display();
+    }
+    
+    /* every image is mapped and checked before any of them is copied */
+    image_plan plan;
+    if ((!plan_images(plan, images) && (plan.failed != SIZE_MAX || !allow_overlap)) || !vm.load_images(plan))
+    {
+        printf("%s\n", plan_error(plan).c_str());
+        exit(1);
+    }
+    /* the first checkpoint holds the images */
+    if (trace_path && !vm.enable_trace(trace_path, trace_every))
+    {
+        printf("failed to write trace: %s\n", trace_path);
+        exit(1);
+    }
+    /* a snapshot among the images makes the machine warm */
+    if (fuzz.runs)
+    {
+        fuzz.input = input_path;
+        fuzz.budget = batch.max_cycles;
+        exit(run_fuzz(vm, fuzz));
+    }
+
+    script_io script;
+    if (headless)
+    {
+        /* Headless Setup */
+        /* no terminal is switched to raw mode and no threads start. stdin is read
+           whole before the guest runs, so it sees exactly the same keys every time */
+        int ok = 1;
+        script.in = input_path ? read_file(input_path, &ok) : read_stream(stdin);
+        if (!ok)
         {
-            reg[r0] = reg[r1] + imm5;
+            printf("failed to read input: %s\n", input_path);
+            exit(1);
         }
-        else
+        if (output_path && !(script.out = fopen(output_path, "wb")))
         {
-            reg[r0] = reg[r1] + reg[r2];
+            printf("failed to open output: %s\n", output_path);
+            exit(1);
         }
+        vm.io = &script;
+
     }
-    if (0x0020 & opbit)  // AND
+    else
     {
-        if (imm_flag)
+        /* Setup */
+        signal(SIGINT, handle_interrupt);
+        disable_input_buffering();
+
+        console_start();
+    }
+
+    if (profile_path)
+    {
+        vm.enable_profile();
+    }
+    else if (use_jit && !vm.enable_jit())
+    {
+        fprintf(stderr, "jit unavailable, falling back to the interpreter\n");
+    }
+    vm.specialize();
+    if (analyze)
+    {
+        /* Analyze Images */
+        /* after the JIT is on, so the blocks the map finds get compiled too */
+        std::unique_ptr<code_map> map(new code_map);
+        code_map_build(vm, *map);
+        code_map_preload(vm, *map);
+        code_map_report(*map, stderr);
+
+    }
+    if (gdb_port)
+    {
+        /* Debug Session */
+        /* the guest runs under gdb until it detaches, and on from there as usual */
+        fprintf(stderr, "gdb: waiting on port %d\n", gdb_port);
+        int fd = gdb_accept(gdb_port);
+        if (fd < 0)
         {
-            reg[r0] = reg[r1] & imm5;
+            fprintf(stderr, "gdb: cannot listen on port %d\n", gdb_port);
+            vm.running = false;
+            status = 1;
         }
         else
         {
-            reg[r0] = reg[r1] & reg[r2];
+            if (gdb_serve(vm, fd) == GDB_KILL) { vm.running = false; }
+            close(fd);
         }
+
+    }
+    /* with --snapshot-at, boot to a point once and start later runs from the file */
+    if (snapshot_path)
+    {
+        vm.run_until(snapshot_at);
     }
-    if (0x0200 & opbit) { reg[r0] = ~reg[r1]; } // NOT
-    if (0x1000 & opbit) { reg[R_PC] = reg[r1]; } // JMP
-    if (0x0010 & opbit)  // JSR
+    else
     {
-        uint16_t long_flag = (instr >> 11) & 1;
-        reg[R_R7] = reg[R_PC];
-        if (long_flag)
+        /* Guarded Run */
+        run_limits limits;
+        limits.budget = batch.max_cycles;
+        limits.timeout = batch.timeout;
+        int result = run_guarded(vm, limits);
+        if (result != RUN_HALTED)
         {
-            pc_plus_off = reg[R_PC] + sign_extend(instr & 0x7FF, 11);
-            reg[R_PC] = pc_plus_off;
+            if (vm.display) { display_close(vm); }
+            vm.io->flush();
+            fprintf(stderr, "\n%s\n", result == RUN_BUDGET ? "instruction budget exhausted" : "timed out");
+            dump_state(vm, stderr);
+            status = result == RUN_BUDGET ? EXIT_BUDGET : EXIT_TIMEOUT;
         }
-        else
-        {
-            reg[R_PC] = reg[r1];
-        }
-    }
-
-    if (0x0004 & opbit) { reg[r0] = mem_read(pc_plus_off); } // LD
-    if (0x0400 & opbit) { reg[r0] = mem_read(mem_read(pc_plus_off)); } // LDI
-    if (0x0040 & opbit) { reg[r0] = mem_read(base_plus_off); }  // LDR
-    if (0x4000 & opbit) { reg[r0] = pc_plus_off; } // LEA
-    if (0x0008 & opbit) { mem_write(pc_plus_off, reg[r0]); } // ST
-    if (0x0800 & opbit) { mem_write(mem_read(pc_plus_off), reg[r0]); } // STI
-    if (0x0080 & opbit) { mem_write(base_plus_off, reg[r0]); } // STR
-    if (0x8000 & opbit)  // TRAP
-    {
-         /* TRAP */
-         switch (instr & 0xFF)
-         {
-             case TRAP_GETC:
-                 /* TRAP GETC */
-                 /* read a single ASCII char */
-                 reg[R_R0] = (uint16_t)getchar();
-                 update_flags(R_R0);
-
-                 break;
-             case TRAP_OUT:
-                 /* TRAP OUT */
-                 putc((char)reg[R_R0], stdout);
-                 fflush(stdout);
-
-                 break;
-             case TRAP_PUTS:
-                 /* TRAP PUTS */
-                 {
-                     /* one char per word */
-                     uint16_t* c = memory + reg[R_R0];
-                     while (*c)
-                     {
-                         putc((char)*c, stdout);
-                         ++c;
-                     }
-                     fflush(stdout);
-                 }
-
-                 break;
-             case TRAP_IN:
-                 /* TRAP IN */
-                 {
-                     printf("Enter a character: ");
-                     char c = getchar();
-                     putc(c, stdout);
-                     fflush(stdout);
-                     reg[R_R0] = (uint16_t)c;
-                     update_flags(R_R0);
-                 }
-
-                 break;
-             case TRAP_PUTSP:
-                 /* TRAP PUTSP */
-                 {
-                     /* one char per byte (two bytes per word)
-                        here we need to swap back to
-                        big endian format */
-                     uint16_t* c = memory + reg[R_R0];
-                     while (*c)
-                     {
-                         char char1 = (*c) & 0xFF;
-                         putc(char1, stdout);
-                         char char2 = (*c) >> 8;
-                         if (char2) putc(char2, stdout);
-                         ++c;
-                     }
-                     fflush(stdout);
-                 }
-
-                 break;
-             case TRAP_HALT:
-                 /* TRAP HALT */
-                 puts("HALT");
-                 fflush(stdout);
-                 running = 0;
-
-                 break;
-         }
-
-    }
-    //if (0x0100 & opbit) { } // RTI
-    if (0x4666 & opbit) { update_flags(r0); }
-}
-
-/* Op Table */
-static void (*op_table[16])(uint16_t) = {
-    ins<0>, ins<1>, ins<2>, ins<3>,
-    ins<4>, ins<5>, ins<6>, ins<7>,
-    NULL, ins<9>, ins<10>, ins<11>,
-    ins<12>, NULL, ins<14>, ins<15>
-};
 
-
-int main(int argc, const char* argv[])
-{
-    /* Load Arguments */
-    if (argc < 2)
+    }
+    if (vm.display)
     {
-        /* show usage string */
-        printf("lc3 [image-file1] ...\n");
-        exit(2);
+        display_close(vm);
     }
-    
-    for (int j = 1; j < argc; ++j)
+    vm.io->flush();
+    if (snapshot_path)
     {
-        if (!read_image(argv[j]))
+        /* Write Snapshot */
+        if (!vm.save_snapshot(snapshot_path))
         {
-            printf("failed to load image: %s\n", argv[j]);
-            exit(1);
+            fprintf(stderr, "failed to write snapshot: %s\n", snapshot_path);
+            status = 1;
         }
-    }
-
-    /* Setup */
-    signal(SIGINT, handle_interrupt);
-    disable_input_buffering();
-
-
-    reg[R_COND] = FL_ZRO;
 
-    enum { PC_START = 0x3000 };
-    reg[R_PC] = PC_START;
+    }
+    if (profile_path)
+    {
+        /* Write Profile */
+        FILE* folded = fopen(profile_path, "w");
+        if (folded)
+        {
+            profile_write_folded(*vm.profile, folded);
+            fclose(folded);
+        }
+        else
+        {
+            fprintf(stderr, "failed to write profile: %s\n", profile_path);
+        }
+        profile_report(*vm.profile, stderr);
 
-    while (running)
+    }
+    if (vm.trace)
     {
-        uint16_t instr = mem_read(reg[R_PC]++);
-        uint16_t op = instr >> 12;
-        op_table[op](instr);
+        /* Finish Trace */
+        uint64_t traced = vm.trace->records;
+        if (vm.disable_trace())
+        {
+            fprintf(stderr, "trace: %llu records in %s\n", (unsigned long long)traced, trace_path);
+        }
+        else
+        {
+            fprintf(stderr, "failed to write trace: %s\n", trace_path);
+            status = 1;
+        }
+
     }
-    /* Shutdown */
-    restore_input_buffering();
+    if (!headless)
+    {
+        /* Shutdown */
+        restore_input_buffering();
 
+    }
+    return status;
 }
 
@@ -0,0 +1,54 @@
+/* lc3-fuzz.cpp */
+/* the entry points for libFuzzer: clang++ -fsanitize=fuzzer lc3-fuzz.cpp.
+   libFuzzer owns the command line, so the images come from LC3_FUZZ_IMAGES,
+   separated by colons, and LC3_FUZZ_OS=1 boots the OS under them. the guest
+   edges are its extra counters, which it clears before each input and reads
+   after. a fault is a crash to libFuzzer, and a hang just a return */
+#include "lc3-vm.h"
+
+using namespace lc3;
+
+__attribute__((section("__libfuzzer_extra_counters")))
+static uint8_t guest_edges[FUZZ_MAP];
+
+static fuzz_target* target;
+
+extern "C" int LLVMFuzzerInitialize(int* argc, char*** argv)
+{
+    const char* list = getenv("LC3_FUZZ_IMAGES");
+    std::vector<std::string> images;
+    for (const char* p = list; p && *p; )
+    {
+        const char* end = strchr(p, ':');
+        if (!end) { end = p + strlen(p); }
+        if (end > p) { images.push_back(std::string(p, end)); }
+        p = *end ? end + 1 : end;
+    }
+    Vm vm;
+    const char* os = getenv("LC3_FUZZ_OS");
+    if (os && strcmp(os, "1") == 0) { vm.boot_os(); }
+    image_plan plan;
+    if (images.empty() || !plan_images(plan, images) || !vm.load_images(plan))
+    {
+        fprintf(stderr, "LC3_FUZZ_IMAGES: %s\n", images.empty() ? "no images" : plan_error(plan).c_str());
+        exit(1);
+    }
+    target = new fuzz_target;
+    if (!fuzz_open(*target, vm, guest_edges))
+    {
+        fprintf(stderr, "failed to freeze the machine for fuzzing\n");
+        exit(1);
+    }
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    if (fuzz_one(*target, data, size) == FUZZ_FAULT)
+    {
+        fprintf(stderr, "fault: vector x%02X at x%04X\n", target->state.fault, target->state.fault_pc);
+        abort();
+    }
+    return 0;
+}
+
@@ -0,0 +1,62 @@
+/* lc3-os-check.cpp */
+/* the OS built into lc3-vm.h is docs/supplies/os.asm assembled by hand
+   once. this assembles the file again, boots the built in copy and
+   compares every word the file fills. on a difference it prints
+   OS_BAD_TRAP, OS_BAD_INT, os_trap_handlers and os_code as they should
+   be, to paste over the old ones, and exits 1. run by make check-os */
+#include "lc3-vm.h"
+
+using namespace lc3;
+
+int main(int argc, char** argv)
+{
+    const char* path = argc > 1 ? argv[1] : "../supplies/os.asm";
+    FILE* f = fopen(path, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "failed to read: %s\n", path);
+        return 2;
+    }
+    std::string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) { text.append(buf, n); }
+    fclose(f);
+    asm_image img;
+    if (!assemble(text.data(), text.size(), img))
+    {
+        fprintf(stderr, "%s: %s\n", path, img.error.c_str());
+        return 2;
+    }
+    if (img.origin != 0 || img.words.size() <= OS_START)
+    {
+        fprintf(stderr, "%s: expected the vector tables at x0000 and code from x%04X\n", path, OS_START);
+        return 2;
+    }
+
+    Vm vm;
+    vm.boot_os();
+    size_t bad = 0;
+    for (size_t a = 0; a < img.words.size(); ++a)
+    {
+        if (vm.memory[a] == img.words[a]) { continue; }
+        if (bad++ < 8) { fprintf(stderr, "x%04X: built in x%04X, %s has x%04X\n", (unsigned)a, vm.memory[a], path, img.words[a]); }
+    }
+    if (!bad)
+    {
+        printf("%s matches the built in OS\n", path);
+        return 0;
+    }
+    fprintf(stderr, "%zu words differ, the tables should be:\n", bad);
+    printf("OS_BAD_TRAP = 0x%04X, OS_BAD_INT = 0x%04X\n\n", img.words[0], img.words[INTERRUPT_TABLE]);
+    printf("const uint16_t os_trap_handlers[] = {");
+    for (int v = TRAP_GETC; v <= TRAP_HALT; ++v) { printf("%s0x%04X", v == TRAP_GETC ? " " : ", ", img.words[v]); }
+    printf(" };\n\nconst uint16_t os_code[] = {");
+    for (size_t a = OS_START; a < img.words.size(); ++a)
+    {
+        printf("%s0x%04X,", (a - OS_START) % 8 ? " " : "\n    ", img.words[a]);
+    }
+    printf("\n};\n");
+    return 1;
+}
+
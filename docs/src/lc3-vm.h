@@ -0,0 +1,6434 @@
+/* lc3-vm.h */
+/* the VM as a library: any number of independent machines in one process */
+#ifndef LC3_VM_H
+#define LC3_VM_H
+
+/* Includes C++ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Dispatch Engine */
+/* build with -DLC3_THREADED=1 for the computed goto engine (GCC/Clang only).
+   every handler ends in its own indirect jump, so the branch predictor keeps
+   one history per instruction instead of sharing the one at the loop top */
+#ifndef LC3_THREADED
+#define LC3_THREADED 0
+#endif
+
+/* the lockstep engine for --wide batches uses GCC vector extensions */
+#ifndef LC3_WIDE
+#if defined(__GNUC__)
+#define LC3_WIDE 1
+#else
+#define LC3_WIDE 0
+#endif
+#endif
+
+/* the --jit mode emits x86-64 */
+#ifndef LC3_JIT
+#if defined(__x86_64__)
+#define LC3_JIT 1
+#else
+#define LC3_JIT 0
+#endif
+#endif
+
+
+namespace lc3
+{
+
+/* Registers */
+enum
+{
+    R_R0 = 0,
+    R_R1,
+    R_R2,
+    R_R3,
+    R_R4,
+    R_R5,
+    R_R6,
+    R_R7,
+    R_PC, /* program counter */
+    R_COND,
+    R_COUNT
+};
+
+/* Condition Flags */
+enum
+{
+    FL_POS = 1 << 0, /* P */
+    FL_ZRO = 1 << 1, /* Z */
+    FL_NEG = 1 << 2, /* N */
+};
+
+/* Opcodes */
+enum
+{
+    OP_BR = 0, /* branch */
+    OP_ADD,    /* add  */
+    OP_LD,     /* load */
+    OP_ST,     /* store */
+    OP_JSR,    /* jump register */
+    OP_AND,    /* bitwise and */
+    OP_LDR,    /* load register */
+    OP_STR,    /* store register */
+    OP_RTI,    /* unused */
+    OP_NOT,    /* bitwise not */
+    OP_LDI,    /* load indirect */
+    OP_STI,    /* store indirect */
+    OP_JMP,    /* jump */
+    OP_RES,    /* reserved (unused) */
+    OP_LEA,    /* load effective address */
+    OP_TRAP    /* execute trap */
+};
+
+
+/* Memory Mapped Registers */
+enum
+{
+    MR_KBSR = 0xFE00, /* keyboard status */
+    MR_KBDR = 0xFE02  /* keyboard data */
+};
+
+/* TRAP Codes */
+enum
+{
+    TRAP_GETC = 0x20,  /* get character from keyboard, not echoed onto the terminal */
+    TRAP_OUT = 0x21,   /* output a character */
+    TRAP_PUTS = 0x22,  /* output a word string */
+    TRAP_IN = 0x23,    /* get character from keyboard, echoed onto the terminal */
+    TRAP_PUTSP = 0x24, /* output a byte string */
+    TRAP_HALT = 0x25   /* halt the program */
+};
+
+
+/* Sign Extend C++ */
+inline uint16_t sign_extend(uint16_t x, int bit_count)
+{
+    if ((x >> (bit_count - 1)) & 1) {
+        x |= (0xFFFF << bit_count);
+    }
+    return x;
+}
+
+inline uint16_t swap16(uint16_t x)
+{
+    return (x << 8) | (x >> 8);
+}
+
+/* swaps n big endian words into dst, 8 or 16 at a time where we can */
+inline void swap16_copy(uint16_t* dst, const uint16_t* src, size_t n)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i mask32 = _mm256_setr_epi8(
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(x, mask32));
+    }
+#endif
+#if defined(__SSSE3__)
+    const __m128i mask16 = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(x, mask16));
+    }
+#elif defined(__SSE2__)
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+        x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+        _mm_storeu_si128((__m128i*)(dst + i), x);
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 8 <= n; i += 8)
+    {
+        uint8x16_t x = vld1q_u8((const uint8_t*)(src + i));
+        vst1q_u8((uint8_t*)(dst + i), vrev16q_u8(x));
+    }
+#endif
+    for (; i < n; ++i) { dst[i] = swap16(src[i]); }
+}
+
+/* Image Format */
+/* the native image format is already swapped. the header takes the first
+   page and the words start at the page holding origin, so every page of
+   guest memory sits at a page aligned offset and can be mapped copy-on-write */
+enum { IMAGE_PAGE = 4096 };
+
+const char IMAGE_MAGIC[8] = { '\x89', 'L', 'C', '3', 'I', 'M', 'G', '\n' };
+const char SNAPSHOT_MAGIC[8] = { '\x89', 'L', 'C', '3', 'S', 'N', 'P', '\n' };
+
+struct image_header
+{
+    char magic[8];
+    uint16_t origin;
+    uint16_t reserved;
+    uint32_t count;
+};
+
+/* count words already in host order, to load at origin */
+inline int write_native_image(const char* out_path, uint16_t origin, const uint16_t* words, uint32_t count)
+{
+    image_header h;
+    memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+    h.origin = origin;
+    h.reserved = 0;
+    h.count = count > 0x10000u - origin ? 0x10000u - origin : count;
+
+    FILE* out = fopen(out_path, "wb");
+    if (!out) { return 0; }
+    static const uint8_t zero[IMAGE_PAGE] = {};
+    fwrite(&h, sizeof(h), 1, out);
+    fwrite(zero, 1, IMAGE_PAGE - sizeof(h), out);
+    fwrite(zero, 1, (2 * h.origin) % IMAGE_PAGE, out);
+    fwrite(words, sizeof(uint16_t), h.count, out);
+    return fclose(out) == 0;
+}
+
+/* writes an .obj file out in the native format */
+inline int convert_image(const char* obj_path, const char* out_path)
+{
+    FILE* in = fopen(obj_path, "rb");
+    if (!in) { return 0; }
+    std::vector<uint16_t> words(UINT16_MAX + 2);
+    size_t read = fread(words.data(), sizeof(uint16_t), words.size(), in);
+    fclose(in);
+    if (read < 1) { return 0; }
+    swap16_copy(&words[1], &words[1], read - 1);
+    return write_native_image(out_path, swap16(words[0]), &words[1], read - 1);
+}
+
+/* Console */
+/* how a VM talks to the outside world. like check_key and getchar, ready()
+   counts the end of input as a key and getc() then returns EOF */
+struct vm_io
+{
+    virtual ~vm_io() {}
+    virtual bool ready() = 0;
+    virtual int getc() = 0;
+    virtual void put(const char* s, size_t n) = 0;
+    virtual void flush() {}
+    /* sleeps until ready() or timeout, and returns ready(). input that
+       cannot come in later does not wait */
+    virtual bool wait(std::chrono::nanoseconds timeout) { return ready(); }
+};
+
+/* Output Buffer */
+/* guest output is batched and written when the guest waits for input,
+   halts, fills the buffer, or delay after the first pending byte */
+enum { OUTPUT_BUFFER_SIZE = 1 << 16 };
+
+struct output_state
+{
+    char data[OUTPUT_BUFFER_SIZE];
+    size_t size = 0;
+    size_t limit = 1 << 14;
+    std::chrono::milliseconds delay{16};
+    int fd = STDOUT_FILENO;
+    std::atomic<bool> pending{false};
+    std::atomic<uint64_t> writes{0}; /* write() calls made */
+    std::mutex lock;
+    std::condition_variable ready;
+};
+
+/* never destroyed, the flusher thread is still waiting on it at exit */
+inline output_state& output()
+{
+    static output_state& out = *new output_state;
+    return out;
+}
+
+/* call with the lock held */
+inline void output_drain(output_state& out)
+{
+    size_t done = 0;
+    while (done < out.size)
+    {
+        ssize_t n = write(out.fd, out.data + done, out.size - done);
+        out.writes.fetch_add(1, std::memory_order_relaxed);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { break; }
+        done += n;
+    }
+    out.size = 0;
+    out.pending.store(false, std::memory_order_relaxed);
+}
+
+inline void output_flush()
+{
+    output_state& out = output();
+    if (!out.pending.load(std::memory_order_relaxed)) { return; }
+    std::lock_guard<std::mutex> guard(out.lock);
+    output_drain(out);
+}
+
+inline void output_put(const char* s, size_t n)
+{
+    output_state& out = output();
+    std::lock_guard<std::mutex> guard(out.lock);
+    while (n > 0)
+    {
+        size_t room = out.limit - out.size;
+        size_t chunk = n < room ? n : room;
+        memcpy(out.data + out.size, s, chunk);
+        out.size += chunk;
+        s += chunk;
+        n -= chunk;
+        if (out.size == out.limit) { output_drain(out); }
+    }
+    /* a drain above clears pending, so what was left after it needs it set again */
+    if (out.size && !out.pending.load(std::memory_order_relaxed))
+    {
+        out.pending.store(true, std::memory_order_relaxed);
+        out.ready.notify_one();
+    }
+}
+
+/* writes output nobody flushed within delay */
+inline void output_flusher()
+{
+    output_state& out = output();
+    std::unique_lock<std::mutex> guard(out.lock);
+    for (;;)
+    {
+        out.ready.wait(guard, [&] { return out.size != 0; });
+        out.ready.wait_for(guard, out.delay, [&] { return out.size == 0; });
+        if (out.size) { output_drain(out); }
+    }
+}
+
+/* Input Thread */
+/* a reader thread owns stdin and fills a single producer, single consumer
+   ring. polling KBSR is then a load and an atomic compare, not a select() */
+enum { INPUT_RING_SIZE = 1 << 12 };
+
+struct input_ring
+{
+    uint8_t data[INPUT_RING_SIZE];
+    std::atomic<uint32_t> head{0}; /* written by the reader */
+    std::atomic<uint32_t> tail{0}; /* written by the VM */
+    std::atomic<bool> eof{false};
+    std::mutex lock;               /* only taken to sleep on an empty ring */
+    std::condition_variable ready;
+};
+
+/* never destroyed, the reader thread outlives main */
+inline input_ring& input()
+{
+    static input_ring& in = *new input_ring;
+    return in;
+}
+
+inline void input_wake(input_ring& in)
+{
+    { std::lock_guard<std::mutex> guard(in.lock); }
+    in.ready.notify_one();
+}
+
+inline void input_reader()
+{
+    input_ring& in = input();
+    uint8_t buf[256];
+    for (;;)
+    {
+        ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { break; }
+
+        for (ssize_t i = 0; i < n; ++i)
+        {
+            uint32_t head = in.head.load(std::memory_order_relaxed);
+            while (head - in.tail.load(std::memory_order_acquire) == INPUT_RING_SIZE)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            in.data[head % INPUT_RING_SIZE] = buf[i];
+            in.head.store(head + 1, std::memory_order_release);
+        }
+        input_wake(in);
+    }
+    in.eof.store(true, std::memory_order_release);
+    input_wake(in);
+}
+
+/* like check_key, the end of input counts as a key so reads can see EOF */
+inline bool input_ready()
+{
+    input_ring& in = input();
+    return in.head.load(std::memory_order_acquire) != in.tail.load(std::memory_order_relaxed)
+        || in.eof.load(std::memory_order_acquire);
+}
+
+/* blocks like getchar */
+inline int input_getc()
+{
+    input_ring& in = input();
+    output_flush();
+    if (!input_ready())
+    {
+        std::unique_lock<std::mutex> guard(in.lock);
+        in.ready.wait(guard, input_ready);
+    }
+    uint32_t tail = in.tail.load(std::memory_order_relaxed);
+    if (tail == in.head.load(std::memory_order_acquire)) { return EOF; }
+    int c = in.data[tail % INPUT_RING_SIZE];
+    in.tail.store(tail + 1, std::memory_order_release);
+    return c;
+}
+
+/* like input_getc without taking the key, false if none came in time */
+inline bool input_wait(std::chrono::nanoseconds timeout)
+{
+    input_ring& in = input();
+    if (input_ready()) { return true; }
+    output_flush();
+    std::unique_lock<std::mutex> guard(in.lock);
+    return in.ready.wait_for(guard, timeout, input_ready);
+}
+
+
+/* stdin and stdout, shared by every VM that does not bring its own I/O.
+   console_start() has to run before a guest reads from it */
+struct console_io final : vm_io
+{
+    bool ready() override { return input_ready(); }
+    int getc() override { return input_getc(); }
+    void put(const char* s, size_t n) override { output_put(s, n); }
+    void flush() override { output_flush(); }
+    bool wait(std::chrono::nanoseconds timeout) override { return input_wait(timeout); }
+};
+
+inline console_io& console()
+{
+    static console_io io;
+    return io;
+}
+
+inline void output_start()
+{
+    output();
+    std::thread(output_flusher).detach();
+}
+
+inline void console_start()
+{
+    output_start();
+    input();
+    std::thread(input_reader).detach();
+}
+
+/* guest I/O kept in memory, for running without a terminal. the input
+   never blocks, once it runs out every read sees EOF. output past
+   out_limit is dropped and sets full */
+struct buffer_io final : vm_io
+{
+    std::string in;
+    size_t in_pos = 0;
+    std::string out;
+    size_t out_limit = SIZE_MAX;
+    bool full = false;
+
+    bool ready() override { return true; }
+    int getc() override { return in_pos < in.size() ? (uint8_t)in[in_pos++] : EOF; }
+    void put(const char* s, size_t n) override
+    {
+        if (n > out_limit - out.size())
+        {
+            n = out_limit - out.size();
+            full = true;
+        }
+        out.append(s, n);
+    }
+};
+
+/* a scripted session: keys come from a string and output goes to a stdio
+   stream. nothing here waits, looks at the clock or touches a terminal,
+   so the same script always replays the same run. output is pushed out
+   whenever the guest reads, so a run killed while it spins on the end of
+   its input has written everything it printed */
+struct script_io final : vm_io
+{
+    std::string in;
+    size_t in_pos = 0;
+    FILE* out = stdout;
+
+    bool ready() override { return true; }
+    int getc() override
+    {
+        fflush(out);
+        return in_pos < in.size() ? (uint8_t)in[in_pos++] : EOF;
+    }
+    void put(const char* s, size_t n) override { fwrite(s, 1, n, out); }
+    void flush() override { fflush(out); }
+};
+
+/* Metrics */
+/* live counts for a host running many guests, to find the ones spinning
+   on KBSR or burning through instructions. a Vm is driven by one thread
+   at a time, so each counter has one writer and goes up with a plain load
+   and store, never a locked instruction, while other threads read it when
+   they like. nothing is counted per instruction: run_until publishes
+   cpu.cycles once a slice and the rest is counted on slow paths */
+struct metric
+{
+    std::atomic<uint64_t> value{0};
+
+    metric() {}
+    metric(const metric& m) : value(m.get()) {}
+    void add(uint64_t n) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    void set(uint64_t n) { value.store(n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+/* the host owns these and points Vm::metrics at them, so they outlive the machine */
+struct vm_metrics
+{
+    metric instructions;    /* cpu.cycles as of the last slice */
+    metric run_ns;          /* time in run_until, waiting for keys included */
+    metric wait_ns;         /* time blocked on input, see metered_io */
+    metric kbsr_polls;
+    metric kbsr_empty;      /* polls that found no key */
+    metric output_bytes;    /* see metered_io */
+    metric decodes;         /* decode cache misses */
+    metric jit_blocks;      /* blocks compiled */
+    metric jit_interpreted; /* instructions compiled code left to the interpreter */
+    metric traps[256];      /* by vector, the OS's own included */
+
+    /* at the end of a slice that began at start, returns now */
+    std::chrono::steady_clock::time_point slice(uint64_t cycles, std::chrono::steady_clock::time_point start)
+    {
+        auto now = std::chrono::steady_clock::now();
+        instructions.set(cycles);
+        run_ns.add(std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count());
+        return now;
+    }
+};
+
+/* wraps the io of a guest to count its output and the time it sits
+   waiting for input. the clock is only read when input is not ready */
+struct metered_io final : vm_io
+{
+    vm_io* io = NULL;
+    vm_metrics* metrics = NULL;
+
+    bool ready() override { return io->ready(); }
+    int getc() override
+    {
+        if (io->ready()) { return io->getc(); }
+        auto start = std::chrono::steady_clock::now();
+        int c = io->getc();
+        waited(start);
+        return c;
+    }
+    void put(const char* s, size_t n) override
+    {
+        metrics->output_bytes.add(n);
+        io->put(s, n);
+    }
+    void flush() override { io->flush(); }
+    bool wait(std::chrono::nanoseconds timeout) override
+    {
+        auto start = std::chrono::steady_clock::now();
+        bool ready = io->wait(timeout);
+        waited(start);
+        return ready;
+    }
+
+    void waited(std::chrono::steady_clock::time_point start)
+    {
+        metrics->wait_ns.add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+};
+
+/* the counters as of one read */
+struct metrics_sample
+{
+    uint64_t instructions = 0, run_ns = 0, wait_ns = 0, kbsr_polls = 0, kbsr_empty = 0;
+    uint64_t output_bytes = 0, decodes = 0, jit_blocks = 0, jit_interpreted = 0;
+    uint64_t traps[256] = {};
+
+    metrics_sample() {}
+    explicit metrics_sample(const vm_metrics& m)
+        : instructions(m.instructions.get()), run_ns(m.run_ns.get()), wait_ns(m.wait_ns.get()),
+          kbsr_polls(m.kbsr_polls.get()), kbsr_empty(m.kbsr_empty.get()), output_bytes(m.output_bytes.get()),
+          decodes(m.decodes.get()), jit_blocks(m.jit_blocks.get()), jit_interpreted(m.jit_interpreted.get())
+    {
+        for (int i = 0; i < 256; ++i) { traps[i] = m.traps[i].get(); }
+    }
+
+    metrics_sample& operator+=(const metrics_sample& s)
+    {
+        instructions += s.instructions;
+        run_ns += s.run_ns;
+        wait_ns += s.wait_ns;
+        kbsr_polls += s.kbsr_polls;
+        kbsr_empty += s.kbsr_empty;
+        output_bytes += s.output_bytes;
+        decodes += s.decodes;
+        jit_blocks += s.jit_blocks;
+        jit_interpreted += s.jit_interpreted;
+        for (int i = 0; i < 256; ++i) { traps[i] += s.traps[i]; }
+        return *this;
+    }
+};
+
+/* what the exports show of a guest. rates are over the seconds between
+   two samples, the ratios over its whole run */
+enum { METRICS_FIELDS = 11 };
+
+struct metrics_field
+{
+    const char* name;
+    const char* help;
+    bool counter;
+};
+
+const metrics_field metrics_fields[METRICS_FIELDS] = {
+    { "instructions", "Instructions retired.", true },
+    { "mips", "Millions of instructions retired per second of wall clock.", false },
+    { "run_seconds", "Time spent running, blocked on input included.", true },
+    { "input_wait_seconds", "Time spent blocked on input.", true },
+    { "kbsr_polls", "Reads of the keyboard status register.", true },
+    { "kbsr_polls_per_second", "Reads of the keyboard status register per second.", false },
+    { "kbsr_empty_polls", "Reads of the keyboard status register that found no key.", true },
+    { "output_bytes", "Bytes of output.", true },
+    { "decode_hit_ratio", "Instructions run from the decode cache without decoding them.", false },
+    { "jit_blocks", "Blocks of compiled code built.", true },
+    { "jit_hit_ratio", "Instructions run as compiled code.", false },
+};
+
+inline void metrics_values(const metrics_sample& now, const metrics_sample& before, double seconds,
+                           double v[METRICS_FIELDS])
+{
+    double ran = (double)now.instructions;
+    v[0] = ran;
+    v[1] = seconds > 0 ? (now.instructions - before.instructions) / seconds / 1e6 : 0;
+    v[2] = now.run_ns / 1e9;
+    v[3] = now.wait_ns / 1e9;
+    v[4] = (double)now.kbsr_polls;
+    v[5] = seconds > 0 ? (now.kbsr_polls - before.kbsr_polls) / seconds : 0;
+    v[6] = (double)now.kbsr_empty;
+    v[7] = (double)now.output_bytes;
+    v[8] = ran > 0 ? 1 - std::min(now.decodes / ran, 1.0) : 0;
+    v[9] = (double)now.jit_blocks;
+    v[10] = ran > 0 && now.jit_blocks ? 1 - std::min(now.jit_interpreted / ran, 1.0) : 0;
+}
+
+inline void metrics_number(std::string& out, double v)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), v < 1e18 && v == (double)(uint64_t)v ? "%.0f" : "%.6g", v);
+    out += buf;
+}
+
+/* a label value or JSON string, the two escape the same few characters */
+inline void metrics_quote(std::string& out, const std::string& s)
+{
+    out += '"';
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\') { out += '\\'; }
+        if (c == '\n') { out += "\\n"; }
+        else { out += (unsigned char)c < 0x20 ? '?' : c; }
+    }
+    out += '"';
+}
+
+/* the Prometheus text format, one series per guest. before holds the
+   samples of the last export, seconds ago */
+inline std::string metrics_prometheus(const std::vector<std::string>& names, const std::vector<metrics_sample>& now,
+                                      const std::vector<metrics_sample>& before, double seconds)
+{
+    std::vector<double> v(names.size() * METRICS_FIELDS);
+    for (size_t g = 0; g < names.size(); ++g) { metrics_values(now[g], before[g], seconds, &v[g * METRICS_FIELDS]); }
+    std::string out;
+    for (int f = 0; f < METRICS_FIELDS; ++f)
+    {
+        std::string name = std::string("lc3_") + metrics_fields[f].name + (metrics_fields[f].counter ? "_total" : "");
+        out += "# HELP " + name + " " + metrics_fields[f].help + "\n";
+        out += "# TYPE " + name + (metrics_fields[f].counter ? " counter\n" : " gauge\n");
+        for (size_t g = 0; g < names.size(); ++g)
+        {
+            out += name + "{guest=";
+            metrics_quote(out, names[g]);
+            out += "} ";
+            metrics_number(out, v[g * METRICS_FIELDS + f]);
+            out += '\n';
+        }
+    }
+    out += "# HELP lc3_traps_total TRAPs taken, by vector.\n# TYPE lc3_traps_total counter\n";
+    for (size_t g = 0; g < names.size(); ++g)
+    {
+        for (int t = 0; t < 256; ++t)
+        {
+            if (!now[g].traps[t]) { continue; }
+            char vector[32];
+            snprintf(vector, sizeof(vector), ",vector=\"x%02X\"} ", t);
+            out += "lc3_traps_total{guest=";
+            metrics_quote(out, names[g]);
+            out += vector;
+            metrics_number(out, (double)now[g].traps[t]);
+            out += '\n';
+        }
+    }
+    return out;
+}
+
+inline void metrics_json_guest(std::string& out, const metrics_sample& now, const metrics_sample& before, double seconds)
+{
+    double v[METRICS_FIELDS];
+    metrics_values(now, before, seconds, v);
+    for (int f = 0; f < METRICS_FIELDS; ++f)
+    {
+        out += std::string("\"") + metrics_fields[f].name + "\": ";
+        metrics_number(out, v[f]);
+        out += ", ";
+    }
+    out += "\"traps\": {";
+    const char* sep = "";
+    for (int t = 0; t < 256; ++t)
+    {
+        if (!now.traps[t]) { continue; }
+        char key[32];
+        snprintf(key, sizeof(key), "%s\"x%02X\": ", sep, t);
+        out += key;
+        metrics_number(out, (double)now.traps[t]);
+        sep = ", ";
+    }
+    out += "}}";
+}
+
+/* a JSON object with a line per guest and their sum in "total" */
+inline std::string metrics_json(const std::vector<std::string>& names, const std::vector<metrics_sample>& now,
+                                const std::vector<metrics_sample>& before, double seconds)
+{
+    std::string out = "{\"seconds\": ";
+    metrics_number(out, seconds);
+    out += ", \"guests\": [";
+    metrics_sample sum, sum_before;
+    for (size_t g = 0; g < names.size(); ++g)
+    {
+        out += g ? ",\n  {\"guest\": " : "\n  {\"guest\": ";
+        metrics_quote(out, names[g]);
+        out += ", ";
+        metrics_json_guest(out, now[g], before[g], seconds);
+        sum += now[g];
+        sum_before += before[g];
+    }
+    out += "],\n \"total\": {";
+    metrics_json_guest(out, sum, sum_before, seconds);
+    out += "}\n";
+    return out;
+}
+
+/* Vm */
+struct Vm;
+
+/* an instruction with its operands already extracted */
+struct decoded
+{
+    void (*fn)(Vm&, const decoded&);
+    uint16_t instr;
+    uint16_t imm5;
+    uint16_t pc_plus_off; /* resolved at decode time, the PC is known */
+    uint16_t base_off;
+    uint8_t op;   /* an opcode, OP_DECODE, or a superinstruction */
+    uint8_t len;  /* instructions fn runs */
+    uint8_t r0, r1, r2, cond, imm_flag, long_flag;
+    uint8_t pad[8];
+};
+
+/* the decode cache comes in pages of 256 entries, one per 256 words of
+   guest memory. at 32 bytes an entry each page is two host pages, which
+   lets it be dropped on its own, see decode_page_drop */
+enum
+{
+    DECODE_PAGE_WORDS = 256,
+    DECODE_PAGES = 256,
+    DECODE_PAGE_SIZE = DECODE_PAGE_WORDS * sizeof(decoded),
+    DECODE_CACHE_SIZE = DECODE_PAGES * DECODE_PAGE_SIZE
+};
+static_assert(DECODE_PAGE_SIZE % IMAGE_PAGE == 0, "decode pages have to fill host pages");
+
+/* the pages of one Vm's cache that hold decoded entries */
+struct decode_pages
+{
+    unsigned limit = DECODE_PAGES;
+    unsigned used = 0;
+    unsigned next = 0;               /* the oldest in order, once limit are in use */
+    uint8_t order[DECODE_PAGES];     /* in the order they were first decoded */
+    bool resident[DECODE_PAGES] = {};
+};
+
+/* the op of an entry that has not been decoded yet, and of the fused ones */
+enum
+{
+    OP_DECODE = 16,
+    FUSE_CONST,
+    FUSE_ADD_BR,
+    FUSE_LD_JSRR,
+    FUSE_RMW,
+    OP_BREAK,     /* a debugger's breakpoint, see Breakpoints */
+    FUSE_MAX_LEN = 3
+};
+
+/* everything from DEVICE_BASE up is device space, split into 256 word
+   pages that devices claim one at a time. a page without a handler
+   behaves like plain memory. */
+enum
+{
+    DEVICE_BASE = 0xFE00,
+    DEVICE_PAGES = (0x10000 - DEVICE_BASE) >> 8
+};
+
+typedef uint16_t (*device_read_fn)(Vm& vm, uint16_t address);
+typedef void (*device_write_fn)(Vm& vm, uint16_t address, uint16_t val);
+
+struct device_page
+{
+    device_read_fn read;
+    device_write_fn write;
+};
+
+/* the registers in one block, so compiled code reaches all of it from one
+   base register. only BR reads the condition codes, so instead of computing
+   them after every instruction the engine keeps the last result and derives
+   N/Z/P when it is asked for them */
+struct cpu_state
+{
+    uint16_t reg[R_COUNT];
+    uint16_t flag_result;
+    uint64_t cycles; /* instructions retired */
+    uint64_t limit;  /* where run_until stops */
+    uint16_t psr;    /* privilege and priority, the condition codes come from flag_result */
+    uint16_t saved_ssp; /* R6 of the mode that is not running */
+    uint16_t saved_usp;
+};
+
+/* the PSR keeps the condition codes in its low bits. a machine starts in
+   supervisor mode at priority 0, the OS drops to user mode with JMPT */
+enum
+{
+    PSR_USER = 1 << 15,
+    PSR_PRIORITY = 7 << 8,
+    SUPERVISOR_STACK = 0x3000  /* grows down below the user's programs */
+};
+
+/* what the guest enabled through KBSR and TR, see Interrupts */
+struct interrupt_state
+{
+    bool keyboard = false;  /* KBSR bit 14 */
+    bool timer = false;     /* TR bit 14 */
+    bool fired = false;     /* TR bit 15, an interval passed since it was last seen */
+    bool latched = false;   /* an interrupt took a key into KBDR the guest has not read */
+    uint16_t interval = 0;  /* TMI in milliseconds, 0 stops the timer */
+    std::chrono::steady_clock::time_point next;
+};
+
+struct jit_state;
+struct profile_state;
+struct vm_snapshot;
+struct image_plan;
+struct display_state;
+struct trace_state;
+struct debug_state;
+struct fuzz_state;
+
+enum
+{
+    PC_START = 0x3000,
+    MEMORY_SIZE = (UINT16_MAX + 1) * sizeof(uint16_t),
+    TRACE_INTERVAL = 1 << 22  /* instructions between the checkpoints of a trace */
+};
+
+/* one guest machine. nothing it runs touches another Vm, so a process can
+   hold as many as it likes, each driven by one thread at a time */
+struct Vm
+{
+    uint16_t* memory;  /* 65536 locations, page aligned so images can be mapped straight in */
+    cpu_state cpu;
+    bool running;      /* cleared by HALT */
+    bool os;           /* TRAPs go through the vector table, see boot_os */
+    vm_io* io;
+    device_page devices[DEVICE_PAGES];
+    decoded* decode_cache; /* one entry per address, filled lazily */
+    decode_pages pages;
+    jit_state* jit;
+    profile_state* profile; /* counts kept while profiling, or NULL */
+    display_state* display; /* the text screen at MR_VRAM, or NULL */
+    trace_state* trace;     /* the recorder while tracing, or NULL */
+    debug_state* debug;     /* breakpoints while a debugger is attached, or NULL */
+    uint64_t (*engine)(Vm& vm, uint64_t n); /* the interpreter run_until uses, NULL for the plain one */
+    fuzz_state* fuzz;       /* coverage while a fuzz_target drives this machine, or NULL */
+    vm_metrics* metrics;    /* counters a host reads while this machine runs, or NULL */
+    uint64_t dirty[DECODE_PAGES / 64]; /* a bit for each page of 256 words, see page_dirty */
+    uint32_t code_generation[DECODE_PAGES]; /* changes when code decoded or compiled from a page may be stale */
+    interrupt_state irq;
+    bool idle;         /* a KBSR poll with no key waits a little for one */
+
+    Vm();
+    explicit Vm(const vm_snapshot& s);
+    ~Vm();
+    Vm(const Vm&) = delete;
+    Vm& operator=(const Vm&) = delete;
+
+    /* reads an .obj or native image into memory, 0 on failure. a snapshot
+       file also brings back the registers */
+    int load_image(const char* image_path);
+    /* loads the files of a plan together, 0 if any of them failed */
+    int load_images(const image_plan& plan, unsigned threads = 0);
+
+    /* freezes the machine, NULL if it cannot be done */
+    std::shared_ptr<vm_snapshot> snapshot() const;
+    /* continues from s, 0 on failure */
+    int restore(const vm_snapshot& s);
+    /* a new machine sharing this one's memory copy-on-write */
+    std::unique_ptr<Vm> fork() const;
+    int save_snapshot(const char* path) const;
+
+    /* starts over at pc with Z set in supervisor mode and interrupts off,
+       memory and cycles are left alone */
+    void reset(uint16_t pc = PC_START);
+
+    /* installs the built in OS and starts over at its entry point, which
+       continues at PC_START. load images after it */
+    void boot_os();
+
+    /* run_until executes until cpu.cycles reaches cycles, step for n more
+       instructions. both stop early at HALT and return the count retired */
+    uint64_t run_until(uint64_t cycles);
+    uint64_t step(uint64_t n);
+
+    /* the architectural registers, as a debugger or host should see them.
+       the engines only keep the result R_COND is derived from, so writing
+       it anything but exactly one of N, Z and P fails with 0 and changes
+       nothing, an eager engine would have kept no flag or several */
+    uint16_t read_reg(int r) const;
+    int write_reg(int r, uint16_t val);
+
+    uint16_t mem_read(uint16_t address);
+    void mem_write(uint16_t address, uint16_t val);
+
+    /* every store the engines make, compiled code included, marks its page
+       of 256 words until clear_dirty. loading images or a snapshot does
+       not, those replace memory under the engines and reset code_generation */
+    bool page_dirty(unsigned page) const;
+    void clear_dirty();
+
+    void device_map(uint16_t page, device_read_fn read, device_write_fn write);
+
+    /* switches run_until to compiled code, 0 if it is not available */
+    int enable_jit();
+
+    /* keeps at most n pages of 256 decoded instructions, 0 for no limit.
+       past that the oldest page is dropped and decoded again when it runs */
+    void decode_limit(unsigned n);
+
+    /* switches run_until to the counting interpreter, ahead of compiled code */
+    profile_state& enable_profile();
+
+    /* maps the text screen into the keyboard's device page */
+    display_state& enable_display();
+
+    /* records every instruction run_until retires into a trace file, with
+       a checkpoint every interval instructions. ahead of compiled code,
+       0 if the file cannot be written. with no path the trace stays in
+       memory, for a debugger to go back through */
+    int enable_trace(const char* path, uint64_t interval = TRACE_INTERVAL);
+    /* ends the trace with a last checkpoint, 0 if the file came out short */
+    int disable_trace();
+
+    /* attaches the breakpoints of a debugger, see Breakpoints. compiled
+       code never looks at them and is dropped */
+    debug_state& enable_debug();
+
+    /* has run_until interpret with handlers built for the devices and I/O
+       this machine has now, see Engine Policies. mapping a device or
+       switching to compiled code goes back to the plain ones, changing io
+       needs another call */
+    void specialize();
+};
+
+inline void update_flags(Vm& vm, uint16_t r)
+{
+    vm.cpu.flag_result = vm.cpu.reg[r];
+}
+
+inline uint16_t cond_flags(const cpu_state& cpu)
+{
+    return cpu.flag_result == 0 ? FL_ZRO : (cpu.flag_result >> 15 ? FL_NEG : FL_POS);
+}
+
+inline uint16_t Vm::read_reg(int r) const
+{
+    return r == R_COND ? cond_flags(cpu) : cpu.reg[r];
+}
+
+inline bool cond_valid(uint16_t val)
+{
+    return val == FL_NEG || val == FL_ZRO || val == FL_POS;
+}
+
+inline int Vm::write_reg(int r, uint16_t val)
+{
+    if (r == R_COND)
+    {
+        if (!cond_valid(val)) { return 0; }
+        /* pick a result that produces the flag */
+        cpu.flag_result = val == FL_NEG ? 0x8000 : val == FL_ZRO ? 0 : 1;
+    }
+    cpu.reg[r] = val;
+    return 1;
+}
+
+inline void Vm::reset(uint16_t pc)
+{
+    write_reg(R_COND, FL_ZRO);
+    write_reg(R_PC, pc);
+    cpu.psr = 0;
+    cpu.saved_ssp = SUPERVISOR_STACK;
+    cpu.saved_usp = 0;
+    irq = interrupt_state();
+    running = true;
+}
+
+/* Interrupts */
+/* the LC-3 interrupt model. an enabled device that is ready raises its
+   vector, and the machine takes it between instructions when its priority
+   is above the one in the PSR: PSR and PC go on the supervisor stack, and
+   the handler's RTI pops them again. both devices sit at priority 4 with
+   the timer first, so input that never runs out cannot starve it. the
+   vectors are looked up in the table at x0100 */
+enum
+{
+    MR_TR = 0xFE08,         /* timer, bit 15 reads 1 once an interval passed */
+    MR_TMI = 0xFE0A,        /* timer interval in milliseconds, os.asm writes 40 */
+    INTERRUPT_ENABLE = 1 << 14, /* of KBSR and TR */
+    INTERRUPT_TABLE = 0x0100,
+    INT_PRIVILEGE = 0x00,   /* RTI in user mode */
+    INT_ILLEGAL = 0x01,     /* the reserved opcode */
+    INT_KEYBOARD = 0x80,
+    INT_TIMER = 0x81,
+    INTERRUPT_PRIORITY = 4,
+    INTERRUPT_SLICE = 1 << 12,  /* instructions between looks at the devices */
+    RUN_SLICE = 1 << 16         /* the same while nothing is enabled */
+};
+
+/* the longest the host sleeps on a guest that waits, so a watchdog still
+   gets to look at it */
+const std::chrono::milliseconds IDLE_SLEEP(10);
+const std::chrono::milliseconds IDLE_POLL(1);
+
+inline bool interrupts_armed(const Vm& vm)
+{
+    return vm.irq.keyboard || (vm.irq.timer && vm.irq.interval);
+}
+
+/* the timer runs on host time, intervals missed while nobody looked
+   count once */
+inline void timer_update(Vm& vm)
+{
+    interrupt_state& irq = vm.irq;
+    if (!irq.interval) { return; }
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now < irq.next) { return; }
+    irq.fired = true;
+    irq.next = now + std::chrono::milliseconds(irq.interval);
+}
+
+inline uint16_t timer_read(Vm& vm)
+{
+    timer_update(vm);
+    interrupt_state& irq = vm.irq;
+    vm.memory[MR_TR] = (irq.fired ? 1 << 15 : 0) | (irq.timer ? INTERRUPT_ENABLE : 0);
+    irq.fired = false;
+    return vm.memory[MR_TR];
+}
+
+inline void timer_start(Vm& vm, uint16_t interval)
+{
+    vm.irq.interval = interval;
+    vm.irq.fired = false;
+    vm.irq.next = std::chrono::steady_clock::now() + std::chrono::milliseconds(interval);
+}
+
+/* runs the handler for vector on the supervisor stack */
+inline void interrupt_enter(Vm& vm, uint8_t vector, uint16_t priority)
+{
+    cpu_state& cpu = vm.cpu;
+    uint16_t psr = cpu.psr | cond_flags(cpu);
+    if (cpu.psr & PSR_USER)
+    {
+        cpu.saved_usp = cpu.reg[R_R6];
+        cpu.reg[R_R6] = cpu.saved_ssp;
+    }
+    vm.mem_write(--cpu.reg[R_R6], psr);
+    vm.mem_write(--cpu.reg[R_R6], cpu.reg[R_PC]);
+    cpu.psr = priority << 8;
+    cpu.reg[R_PC] = vm.mem_read(INTERRUPT_TABLE + vector);
+}
+
+/* RTI, only the supervisor may use it */
+inline void interrupt_return(Vm& vm)
+{
+    cpu_state& cpu = vm.cpu;
+    if (cpu.psr & PSR_USER)
+    {
+        interrupt_enter(vm, INT_PRIVILEGE, (cpu.psr & PSR_PRIORITY) >> 8);
+        return;
+    }
+    cpu.reg[R_PC] = vm.mem_read(cpu.reg[R_R6]++);
+    uint16_t psr = vm.mem_read(cpu.reg[R_R6]++);
+    /* a PSR the handler wrote without exactly one flag comes back as Z */
+    uint16_t cond = psr & (FL_NEG | FL_ZRO | FL_POS);
+    vm.write_reg(R_COND, cond_valid(cond) ? cond : FL_ZRO);
+    cpu.psr = psr & (PSR_USER | PSR_PRIORITY);
+    if (cpu.psr & PSR_USER)
+    {
+        cpu.saved_ssp = cpu.reg[R_R6];
+        cpu.reg[R_R6] = cpu.saved_usp;
+    }
+}
+
+inline void trace_interrupt(Vm& vm, uint8_t vector);
+
+/* a trace keeps interrupts as records of their own, see Trace */
+inline void interrupt_raise(Vm& vm, uint8_t vector)
+{
+    if (vm.trace) { trace_interrupt(vm, vector); }
+    else { interrupt_enter(vm, vector, INTERRUPT_PRIORITY); }
+}
+
+/* takes the interrupt a device raises, false if none can be taken now.
+   the key goes into KBDR as the interrupt is taken, so a handler may read
+   KBDR without polling KBSR first */
+inline bool interrupt_take(Vm& vm)
+{
+    interrupt_state& irq = vm.irq;
+    if ((vm.cpu.psr & PSR_PRIORITY) >> 8 >= INTERRUPT_PRIORITY) { return false; }
+    if (irq.timer)
+    {
+        timer_update(vm);
+        if (irq.fired)
+        {
+            irq.fired = false;
+            interrupt_raise(vm, INT_TIMER);
+            return true;
+        }
+    }
+    if (irq.keyboard && !irq.latched && vm.io->ready())
+    {
+        vm.memory[MR_KBSR] = (1 << 15) | INTERRUPT_ENABLE;
+        vm.memory[MR_KBDR] = vm.io->getc();
+        irq.latched = true;
+        interrupt_raise(vm, INT_KEYBOARD);
+        return true;
+    }
+    return false;
+}
+
+/* a guest parked on a branch to itself only moves on when an interrupt
+   comes, so instead of spinning the host sleeps until a key or the timer */
+inline void interrupt_idle(Vm& vm)
+{
+    interrupt_state& irq = vm.irq;
+    uint16_t instr = vm.memory[vm.cpu.reg[R_PC]];
+    bool parked = instr >> 12 == OP_BR && (instr & 0x1FF) == 0x1FF && ((instr >> 9) & cond_flags(vm.cpu));
+    if (!parked || (vm.cpu.psr & PSR_PRIORITY) >> 8 >= INTERRUPT_PRIORITY) { return; }
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point until = now + IDLE_SLEEP;
+    if (irq.timer && irq.interval && irq.next < until) { until = irq.next; }
+    if (irq.keyboard && !irq.latched)
+    {
+        vm.io->wait(until - now);
+    }
+    else
+    {
+        vm.io->flush();
+        std::this_thread::sleep_until(until);
+    }
+}
+
+/* run_until calls this between slices while interrupts are enabled */
+inline void interrupt_poll(Vm& vm)
+{
+    if (interrupt_take(vm)) { return; }
+    interrupt_idle(vm);
+    interrupt_take(vm);
+}
+
+/* Devices */
+inline void Vm::device_map(uint16_t page, device_read_fn read, device_write_fn write)
+{
+    devices[page - (DEVICE_BASE >> 8)] = { read, write };
+    engine = NULL;
+}
+
+inline uint16_t device_read(Vm& vm, uint16_t address)
+{
+    device_page& dev = vm.devices[(address - DEVICE_BASE) >> 8];
+    return dev.read ? dev.read(vm, address) : vm.memory[address];
+}
+
+inline void device_write(Vm& vm, uint16_t address, uint16_t val)
+{
+    device_page& dev = vm.devices[(address - DEVICE_BASE) >> 8];
+    if (dev.write) { dev.write(vm, address, val); }
+}
+
+/* Keyboard, and the timer that shares its page */
+inline uint16_t keyboard_read(Vm& vm, uint16_t address)
+{
+    if (address == MR_KBSR)
+    {
+        uint16_t enable = vm.irq.keyboard ? INTERRUPT_ENABLE : 0;
+        bool ready = vm.irq.latched || vm.io->ready();
+        if (!ready)
+        {
+            /* the guest is waiting for a key, show it everything so far */
+            vm.io->flush();
+            if (vm.idle) { ready = vm.io->wait(IDLE_POLL); }
+        }
+        if (vm.metrics)
+        {
+            vm.metrics->kbsr_polls.add(1);
+            vm.metrics->kbsr_empty.add(!ready);
+        }
+        if (ready && !vm.irq.latched) { vm.memory[MR_KBDR] = vm.io->getc(); }
+        vm.memory[MR_KBSR] = (ready ? 1 << 15 : 0) | enable;
+        vm.irq.latched = false;
+    }
+    else if (address == MR_KBDR)
+    {
+        vm.irq.latched = false;
+    }
+    else if (address == MR_TR)
+    {
+        return timer_read(vm);
+    }
+    return vm.memory[address];
+}
+
+/* mem_write has already stored val */
+inline void keyboard_write(Vm& vm, uint16_t address, uint16_t val)
+{
+    if (address == MR_KBSR) { vm.irq.keyboard = val & INTERRUPT_ENABLE; }
+    else if (address == MR_TR) { vm.irq.timer = val & INTERRUPT_ENABLE; }
+    else if (address == MR_TMI) { timer_start(vm, val); }
+}
+
+/* Memory Access C++ */
+inline void ins_decode(Vm& vm, const decoded& d);
+inline int jit_invalidate(Vm& vm, uint16_t address);
+inline void jit_flush(jit_state& j);
+
+/* a file holding size bytes of data that no path leads to */
+inline int anonymous_file(const void* data, size_t size)
+{
+#if defined(__linux__)
+    int fd = memfd_create("lc3-snapshot", MFD_CLOEXEC);
+#else
+    char path[] = "/tmp/lc3-snapshot-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd >= 0) { unlink(path); }
+#endif
+    if (fd < 0) { return -1; }
+    const char* p = (const char*)data;
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = write(fd, p + done, size - done);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    return fd;
+}
+
+inline int map_private(void* at, size_t size, int fd)
+{
+    return mmap(at, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED;
+}
+
+/* every Vm maps its cache MAP_PRIVATE from one file of undecoded entries.
+   a page that never ran code is never copied, and all of them share the
+   page cache for reads. the first decode in a page copies it */
+inline int decode_template()
+{
+    static int fd = [] {
+        std::vector<decoded> cache(DECODE_PAGES * DECODE_PAGE_WORDS);
+        for (decoded& d : cache)
+        {
+            d.fn = ins_decode;
+            d.op = OP_DECODE;
+            d.len = 1;
+        }
+        return anonymous_file(cache.data(), DECODE_CACHE_SIZE);
+    }();
+    return fd;
+}
+
+inline decoded* decode_cache_map()
+{
+    int fd = decode_template();
+    void* c = fd < 0 ? MAP_FAILED : mmap(NULL, DECODE_CACHE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (c == MAP_FAILED) { throw std::bad_alloc(); }
+    return (decoded*)c;
+}
+
+/* throws the copy away, so the page reads as the undecoded file again */
+inline void decode_page_drop(Vm& vm, unsigned page)
+{
+    decoded* at = vm.decode_cache + page * DECODE_PAGE_WORDS;
+#if defined(__linux__)
+    madvise(at, DECODE_PAGE_SIZE, MADV_DONTNEED);
+#else
+    mmap(at, DECODE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, decode_template(),
+         (off_t)page * DECODE_PAGE_SIZE);
+#endif
+    vm.pages.resident[page] = false;
+}
+
+/* called whenever memory may have changed under the cache, so whoever
+   keeps something made from the code has to look again */
+inline void decode_cache_reset(Vm& vm)
+{
+    for (unsigned i = 0; i < vm.pages.used; ++i) { decode_page_drop(vm, vm.pages.order[i]); }
+    vm.pages.used = 0;
+    vm.pages.next = 0;
+    for (uint32_t& g : vm.code_generation) { ++g; }
+}
+
+/* the entry of an address below DEVICE_BASE, about to be written */
+inline decoded& decode_entry(Vm& vm, uint16_t address)
+{
+    decode_pages& p = vm.pages;
+    unsigned page = address >> 8;
+    if (!p.resident[page])
+    {
+        if (p.used < p.limit)
+        {
+            p.order[p.used++] = page;
+        }
+        else
+        {
+            decode_page_drop(vm, p.order[p.next]);
+            p.order[p.next] = page;
+            p.next = (p.next + 1) % p.limit;
+        }
+        p.resident[page] = true;
+    }
+    return vm.decode_cache[address];
+}
+
+/* a superinstruction also covers the words after it, but never leaves
+   its page. a page nothing was decoded in has nothing to undo, so stores
+   to data never copy it */
+inline void decode_cache_invalidate(Vm& vm, uint16_t address)
+{
+    if (!vm.pages.resident[address >> 8]) { return; }
+    ++vm.code_generation[address >> 8];
+    for (unsigned back = 0; back < FUSE_MAX_LEN && back <= (address & 0xFFu); ++back)
+    {
+        decoded& d = vm.decode_cache[address - back];
+        if (back == 0 || d.len > back)
+        {
+            d.fn = ins_decode;
+            d.op = OP_DECODE;
+            d.len = 1;
+        }
+    }
+}
+
+inline void Vm::decode_limit(unsigned n)
+{
+    pages.limit = n == 0 || n > DECODE_PAGES ? DECODE_PAGES : n;
+    if (pages.used > pages.limit) { decode_cache_reset(*this); }
+}
+
+/* RAM never looks at the device table, and instruction fetch goes
+   through the decode cache which never holds device words */
+inline void Vm::mem_write(uint16_t address, uint16_t val)
+{
+    memory[address] = val;
+    dirty[address >> 14] |= (uint64_t)1 << (address >> 8 & 63);
+    decode_cache_invalidate(*this, address);
+    if (jit) { jit_invalidate(*this, address); }
+    if (address >= DEVICE_BASE) { device_write(*this, address, val); }
+}
+
+inline uint16_t Vm::mem_read(uint16_t address)
+{
+    if (address < DEVICE_BASE) { return memory[address]; }
+    return device_read(*this, address);
+}
+
+inline bool Vm::page_dirty(unsigned page) const
+{
+    return dirty[page >> 6] >> (page & 63) & 1;
+}
+
+inline void Vm::clear_dirty()
+{
+    memset(dirty, 0, sizeof(dirty));
+}
+
+/* Assembler */
+/* a two pass assembler for the syntax of docs/supplies/os.asm, so a
+   source goes straight into a Vm or a native image without an .obj file
+   in between. the first pass splits the lines into statements and gives
+   every label its address, the second encodes them. labels live in a flat
+   table of open addressed slots that point back into the source, so a
+   program costs one allocation for its symbols and none per name */
+struct asm_image
+{
+    uint16_t origin = 0;
+    std::vector<uint16_t> words;
+    std::string error;  /* "line n: why", empty when it assembled */
+};
+
+enum asm_kind
+{
+    ASM_ARITH,   /* ADD and AND, with a register or an imm5 last */
+    ASM_NOT,
+    ASM_BR,
+    ASM_JMP,     /* JMP, JSRR and JMPT, a base register */
+    ASM_RET,
+    ASM_JSR,
+    ASM_PC_OFF,  /* LD, LDI, LEA, ST and STI */
+    ASM_BASE_OFF,/* LDR and STR */
+    ASM_TRAP,
+    ASM_ALIAS,   /* GETC..HALT */
+    ASM_RTI,
+    ASM_ORIG,
+    ASM_FILL,
+    ASM_BLKW,
+    ASM_STRINGZ,
+    ASM_END
+};
+
+struct asm_mnemonic
+{
+    const char* name;
+    uint8_t kind;
+    uint16_t bits;      /* what the encoding starts from */
+};
+
+const asm_mnemonic asm_mnemonics[] = {
+    { "ADD", ASM_ARITH, OP_ADD << 12 }, { "AND", ASM_ARITH, OP_AND << 12 }, { "NOT", ASM_NOT, OP_NOT << 12 | 0x3F },
+    { "BR", ASM_BR, 0x0E00 }, { "BRN", ASM_BR, 0x0800 }, { "BRZ", ASM_BR, 0x0400 },
+    { "BRP", ASM_BR, 0x0200 }, { "BRNZ", ASM_BR, 0x0C00 }, { "BRNP", ASM_BR, 0x0A00 },
+    { "BRZP", ASM_BR, 0x0600 }, { "BRNZP", ASM_BR, 0x0E00 },
+    { "JMP", ASM_JMP, OP_JMP << 12 }, { "JMPT", ASM_JMP, OP_JMP << 12 | 1 }, { "RET", ASM_RET, OP_JMP << 12 | R_R7 << 6 },
+    { "JSR", ASM_JSR, OP_JSR << 12 | 0x0800 }, { "JSRR", ASM_JMP, OP_JSR << 12 },
+    { "LD", ASM_PC_OFF, OP_LD << 12 }, { "LDI", ASM_PC_OFF, OP_LDI << 12 }, { "LEA", ASM_PC_OFF, OP_LEA << 12 },
+    { "ST", ASM_PC_OFF, OP_ST << 12 }, { "STI", ASM_PC_OFF, OP_STI << 12 },
+    { "LDR", ASM_BASE_OFF, OP_LDR << 12 }, { "STR", ASM_BASE_OFF, OP_STR << 12 },
+    { "TRAP", ASM_TRAP, OP_TRAP << 12 }, { "RTI", ASM_RTI, OP_RTI << 12 },
+    { "GETC", ASM_ALIAS, OP_TRAP << 12 | TRAP_GETC }, { "OUT", ASM_ALIAS, OP_TRAP << 12 | TRAP_OUT },
+    { "PUTS", ASM_ALIAS, OP_TRAP << 12 | TRAP_PUTS }, { "IN", ASM_ALIAS, OP_TRAP << 12 | TRAP_IN },
+    { "PUTSP", ASM_ALIAS, OP_TRAP << 12 | TRAP_PUTSP }, { "HALT", ASM_ALIAS, OP_TRAP << 12 | TRAP_HALT },
+    { ".ORIG", ASM_ORIG, 0 }, { ".FILL", ASM_FILL, 0 }, { ".BLKW", ASM_BLKW, 0 },
+    { ".STRINGZ", ASM_STRINGZ, 0 }, { ".END", ASM_END, 0 },
+};
+
+/* a word of the source, by position so nothing is copied */
+struct asm_token
+{
+    uint32_t at;
+    uint32_t len;
+};
+
+struct asm_statement
+{
+    uint32_t line;
+    uint16_t pc;
+    uint8_t mnemonic;   /* into asm_mnemonics */
+    uint8_t operands;
+    asm_token operand[3];
+};
+
+struct asm_symbols
+{
+    struct slot
+    {
+        uint32_t hash;
+        asm_token name;   /* len 0 for a free slot */
+        uint16_t value;
+    };
+    const char* text;
+    std::vector<slot> slots;
+    size_t used = 0;
+
+    explicit asm_symbols(const char* t) : text(t), slots(64) {}
+
+    static uint32_t hash_of(const char* s, size_t n)
+    {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < n; ++i) { h = (h ^ (uint8_t)s[i]) * 16777619u; }
+        return h;
+    }
+
+    slot& probe(const char* s, uint32_t n, uint32_t h)
+    {
+        size_t mask = slots.size() - 1;
+        for (size_t i = h & mask;; i = (i + 1) & mask)
+        {
+            slot& e = slots[i];
+            if (e.name.len == 0) { return e; }
+            if (e.hash == h && e.name.len == n && memcmp(text + e.name.at, s, n) == 0) { return e; }
+        }
+    }
+
+    /* false if the name is already taken */
+    bool insert(asm_token name, uint16_t value)
+    {
+        if (2 * (used + 1) > slots.size())
+        {
+            std::vector<slot> old(2 * slots.size());
+            old.swap(slots);
+            for (const slot& e : old)
+            {
+                if (e.name.len) { probe(text + e.name.at, e.name.len, e.hash) = e; }
+            }
+        }
+        uint32_t h = hash_of(text + name.at, name.len);
+        slot& e = probe(text + name.at, name.len, h);
+        if (e.name.len) { return false; }
+        e.hash = h;
+        e.name = name;
+        e.value = value;
+        ++used;
+        return true;
+    }
+
+    const slot* find(asm_token name)
+    {
+        const slot& e = probe(text + name.at, name.len, hash_of(text + name.at, name.len));
+        return e.name.len ? &e : NULL;
+    }
+};
+
+inline int asm_lookup(const char* s, uint32_t n)
+{
+    char upper[8];
+    if (n > sizeof(upper)) { return -1; }
+    for (uint32_t i = 0; i < n; ++i) { upper[i] = toupper((unsigned char)s[i]); }
+    for (size_t m = 0; m < sizeof(asm_mnemonics) / sizeof(asm_mnemonics[0]); ++m)
+    {
+        const char* name = asm_mnemonics[m].name;
+        if (name[0] == upper[0] && strlen(name) == n && memcmp(name, upper, n) == 0) { return (int)m; }
+    }
+    return -1;
+}
+
+/* #10, x3000, -x5, or plain decimal */
+inline bool asm_number(const char* s, uint32_t n, int32_t& v)
+{
+    uint32_t i = 0;
+    int base = 10;
+    if (i < n && s[i] == '#') { ++i; }
+    else if (i < n && (s[i] == 'x' || s[i] == 'X')) { base = 16; ++i; }
+    bool negative = i < n && s[i] == '-';
+    if (negative) { ++i; }
+    if (base == 10 && i + 1 < n && (s[i] == 'x' || s[i] == 'X')) { base = 16; ++i; }
+    if (i == n) { return false; }
+    int64_t value = 0;
+    for (; i < n; ++i)
+    {
+        int d = isdigit((unsigned char)s[i]) ? s[i] - '0'
+              : base == 16 && isxdigit((unsigned char)s[i]) ? toupper((unsigned char)s[i]) - 'A' + 10 : -1;
+        if (d < 0) { return false; }
+        value = value * base + d;
+        if (value > 0x1FFFF) { return false; }
+    }
+    v = (int32_t)(negative ? -value : value);
+    return true;
+}
+
+/* the one place that knows the line a statement came from */
+struct asm_pass
+{
+    const char* text;
+    asm_image& out;
+    asm_symbols symbols;
+    uint32_t line = 0;
+
+    asm_pass(const char* t, asm_image& o) : text(t), out(o), symbols(t) {}
+
+    bool fail(const char* why, asm_token t = asm_token{0, 0})
+    {
+        char msg[160];
+        snprintf(msg, sizeof(msg), "line %u: %s%s%.*s%s", line, why, t.len ? " '" : "", (int)t.len,
+                 text + t.at, t.len ? "'" : "");
+        out.error = msg;
+        return false;
+    }
+
+    bool reg(asm_token t, uint16_t& r)
+    {
+        const char* s = text + t.at;
+        if (t.len != 2 || (s[0] != 'R' && s[0] != 'r') || s[1] < '0' || s[1] > '7') { return fail("not a register", t); }
+        r = s[1] - '0';
+        return true;
+    }
+
+    /* a number in [lo, hi], or a label when pc is given */
+    bool value(asm_token t, int32_t lo, int32_t hi, int32_t& v, int32_t pc = -1)
+    {
+        if (!asm_number(text + t.at, t.len, v))
+        {
+            const asm_symbols::slot* s = symbols.find(t);
+            if (!s) { return fail("undefined label", t); }
+            v = pc < 0 ? s->value : (int32_t)s->value - pc - 1;
+        }
+        if (v < lo || v > hi) { return fail(pc < 0 ? "value out of range" : "offset out of range", t); }
+        return true;
+    }
+
+    bool offset(asm_token t, unsigned bits, uint16_t pc, uint16_t& field)
+    {
+        int32_t v;
+        if (!value(t, -(1 << (bits - 1)), (1 << (bits - 1)) - 1, v, pc)) { return false; }
+        field = v & ((1 << bits) - 1);
+        return true;
+    }
+};
+
+/* the words of a .STRINGZ, its terminator included */
+inline bool asm_string(const char* s, uint32_t n, std::vector<uint16_t>* words, uint32_t& count)
+{
+    if (n < 2 || s[0] != '"' || s[n - 1] != '"') { return false; }
+    count = 0;
+    for (uint32_t i = 1; i + 1 < n; ++i)
+    {
+        char c = s[i];
+        if (c == '\\' && i + 2 < n)
+        {
+            switch (s[++i])
+            {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case 'e': c = 27; break;
+                case '0': c = 0; break;
+                default: c = s[i]; break;
+            }
+        }
+        if (words) { words->push_back((uint8_t)c); }
+        ++count;
+    }
+    if (words) { words->push_back(0); }
+    ++count;
+    return true;
+}
+
+inline int assemble(const char* text, size_t size, asm_image& out)
+{
+    out.words.clear();
+    out.error.clear();
+    asm_pass p(text, out);
+    std::vector<asm_statement> statements;
+    statements.reserve(size / 16);
+    bool origin = false;
+    uint32_t pc = 0;
+
+    /* the first pass */
+    for (size_t at = 0; at < size;)
+    {
+        ++p.line;
+        size_t end = at;
+        while (end < size && text[end] != '\n') { ++end; }
+        asm_token tokens[5];
+        unsigned n = 0;
+        for (size_t i = at; i < end;)
+        {
+            char c = text[i];
+            if (c == ';') { break; }
+            if (isspace((unsigned char)c) || c == ',') { ++i; continue; }
+            size_t start = i;
+            if (c == '"')
+            {
+                for (++i; i < end && text[i] != '"'; ++i) { i += text[i] == '\\'; }
+                if (i >= end) { return p.fail("unterminated string"); }
+                ++i;
+            }
+            else
+            {
+                while (i < end && !isspace((unsigned char)text[i]) && text[i] != ',' && text[i] != ';') { ++i; }
+            }
+            if (n == 5) { return p.fail("too many operands"); }
+            tokens[n++] = asm_token{ (uint32_t)start, (uint32_t)(i - start) };
+        }
+        at = end + 1;
+        if (n == 0) { continue; }
+
+        unsigned first = 0;
+        int m = asm_lookup(text + tokens[0].at, tokens[0].len);
+        if (m < 0)
+        {
+            asm_token label = tokens[0];
+            if (text[label.at + label.len - 1] == ':') { --label.len; }
+            int32_t ignored;
+            if (!label.len || asm_number(text + label.at, label.len, ignored)) { return p.fail("not a label", label); }
+            if (!origin) { return p.fail("label before .ORIG", label); }
+            if (!p.symbols.insert(label, pc)) { return p.fail("label defined twice", label); }
+            if (n == 1) { continue; }
+            first = 1;
+            m = asm_lookup(text + tokens[1].at, tokens[1].len);
+            if (m < 0) { return p.fail("unknown instruction", tokens[1]); }
+        }
+
+        asm_statement s;
+        s.line = p.line;
+        s.pc = pc;
+        s.mnemonic = m;
+        s.operands = n - first - 1;
+        if (s.operands > 3) { return p.fail("too many operands"); }
+        for (unsigned i = 0; i < s.operands; ++i) { s.operand[i] = tokens[first + 1 + i]; }
+        uint8_t kind = asm_mnemonics[m].kind;
+        if (kind == ASM_END) { break; }
+        if (kind == ASM_ORIG)
+        {
+            int32_t v;
+            if (origin) { return p.fail(".ORIG given twice"); }
+            if (s.operands != 1 || !asm_number(text + s.operand[0].at, s.operand[0].len, v) || v < 0 || v > 0xFFFF)
+            {
+                return p.fail(".ORIG needs an address");
+            }
+            origin = true;
+            out.origin = pc = v;
+            continue;
+        }
+        if (!origin) { return p.fail("code before .ORIG"); }
+
+        uint32_t words = 1;
+        if (kind == ASM_BLKW)
+        {
+            int32_t v;
+            if (s.operands != 1 || !asm_number(text + s.operand[0].at, s.operand[0].len, v) || v < 0)
+            {
+                return p.fail(".BLKW needs a count");
+            }
+            words = v;
+        }
+        else if (kind == ASM_STRINGZ)
+        {
+            if (s.operands != 1 || !asm_string(text + s.operand[0].at, s.operand[0].len, NULL, words))
+            {
+                return p.fail(".STRINGZ needs a string");
+            }
+        }
+        statements.push_back(s);
+        pc += words;
+        if (pc > 0x10000) { return p.fail("past the end of memory"); }
+    }
+    if (!origin) { return p.fail("no .ORIG"); }
+
+    /* the second */
+    out.words.reserve(pc - out.origin);
+    for (const asm_statement& s : statements)
+    {
+        p.line = s.line;
+        const asm_mnemonic& m = asm_mnemonics[s.mnemonic];
+        static const uint8_t wanted[] = { 3, 2, 1, 1, 0, 1, 2, 3, 1, 0, 0, 1, 1, 1, 1, 0 };
+        if (s.operands != wanted[m.kind]) { return p.fail("wrong number of operands"); }
+        const asm_token* o = s.operand;
+        uint16_t w = m.bits, a, b, c;
+        int32_t v = 0;
+        switch (m.kind)
+        {
+            case ASM_ARITH:
+                if (!p.reg(o[0], a) || !p.reg(o[1], b)) { return 0; }
+                w |= a << 9 | b << 6;
+                if (o[2].len == 2 && (text[o[2].at] == 'R' || text[o[2].at] == 'r') && isdigit((unsigned char)text[o[2].at + 1]))
+                {
+                    if (!p.reg(o[2], c)) { return 0; }
+                    w |= c;
+                }
+                else
+                {
+                    if (!p.value(o[2], -16, 15, v)) { return 0; }
+                    w |= 0x20 | (v & 0x1F);
+                }
+                break;
+            case ASM_NOT:
+                if (!p.reg(o[0], a) || !p.reg(o[1], b)) { return 0; }
+                w |= a << 9 | b << 6;
+                break;
+            case ASM_BR:
+                if (!p.offset(o[0], 9, s.pc, a)) { return 0; }
+                w |= a;
+                break;
+            case ASM_JMP:
+                if (!p.reg(o[0], a)) { return 0; }
+                w |= a << 6;
+                break;
+            case ASM_JSR:
+                if (!p.offset(o[0], 11, s.pc, a)) { return 0; }
+                w |= a;
+                break;
+            case ASM_PC_OFF:
+                if (!p.reg(o[0], a) || !p.offset(o[1], 9, s.pc, b)) { return 0; }
+                w |= a << 9 | b;
+                break;
+            case ASM_BASE_OFF:
+                if (!p.reg(o[0], a) || !p.reg(o[1], b) || !p.value(o[2], -32, 31, v)) { return 0; }
+                w |= a << 9 | b << 6 | (v & 0x3F);
+                break;
+            case ASM_TRAP:
+                if (!p.value(o[0], 0, 0xFF, v)) { return 0; }
+                w |= v;
+                break;
+            case ASM_FILL:
+                if (!p.value(o[0], -0x8000, 0xFFFF, v)) { return 0; }
+                w = v;
+                break;
+            case ASM_BLKW:
+                asm_number(text + o[0].at, o[0].len, v);
+                out.words.insert(out.words.end(), v, 0);
+                continue;
+            case ASM_STRINGZ:
+            {
+                uint32_t count;
+                asm_string(text + o[0].at, o[0].len, &out.words, count);
+                continue;
+            }
+        }
+        out.words.push_back(w);
+    }
+    return 1;
+}
+
+/* a program that assembled into memory. the caller drops whatever was
+   decoded from the words, as load_images does once for all of its files */
+inline int asm_copy(Vm& vm, const asm_image& img)
+{
+    if (!img.error.empty()) { return 0; }
+    memcpy(vm.memory + img.origin, img.words.data(), img.words.size() * sizeof(uint16_t));
+    return 1;
+}
+
+/* assembled straight into a Vm, no file involved */
+inline int load_asm_image(Vm& vm, const asm_image& img)
+{
+    if (!asm_copy(vm, img)) { return 0; }
+    decode_cache_reset(vm);
+    if (vm.jit) { jit_flush(*vm.jit); }
+    return 1;
+}
+
+/* sources are told from images by their name, they have no magic */
+inline bool asm_source(const std::string& path)
+{
+    return path.size() > 4 && strcasecmp(path.c_str() + path.size() - 4, ".asm") == 0;
+}
+
+/* assembles a file into the native format, error says why it could not */
+inline int convert_source(const char* asm_path, const char* out_path, std::string& error)
+{
+    std::string text;
+    FILE* in = fopen(asm_path, "rb");
+    if (!in)
+    {
+        error = "cannot read it";
+        return 0;
+    }
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) { text.append(buf, n); }
+    fclose(in);
+    asm_image img;
+    if (!assemble(text.data(), text.size(), img))
+    {
+        error = img.error;
+        return 0;
+    }
+    return write_native_image(out_path, img.origin, img.words.data(), img.words.size());
+}
+
+/* Image Loader */
+inline int load_obj_image(Vm& vm, const uint8_t* file, size_t size)
+{
+    const uint16_t* words = (const uint16_t*)file;
+    uint16_t origin = swap16(words[0]);
+    size_t count = (size - 2) / 2;
+    size_t max_read = 0x10000 - origin;
+    swap16_copy(vm.memory + origin, words + 1, count < max_read ? count : max_read);
+    return 1;
+}
+
+/* the header was checked by plan_image */
+inline int load_native_image(Vm& vm, int fd, const uint8_t* file, size_t size)
+{
+    image_header h;
+    memcpy(&h, file, sizeof(h));
+    size_t begin = 2 * (size_t)h.origin;
+    size_t end = begin + 2 * (size_t)h.count;
+    size_t base = begin - begin % IMAGE_PAGE; /* memory byte at file offset IMAGE_PAGE */
+
+    uint8_t* mem = (uint8_t*)vm.memory;
+    const uint8_t* data = file + IMAGE_PAGE - base;
+    size_t first = (begin + IMAGE_PAGE - 1) / IMAGE_PAGE * IMAGE_PAGE;
+    size_t last = end / IMAGE_PAGE * IMAGE_PAGE;
+
+    /* whole pages are mapped, the ragged ends are copied */
+    if (first < last && sysconf(_SC_PAGESIZE) == IMAGE_PAGE
+        && mmap(mem + first, last - first, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                fd, IMAGE_PAGE + first - base) != MAP_FAILED)
+    {
+        memcpy(mem + begin, data + begin, first - begin);
+        memcpy(mem + last, data + last, end - last);
+    }
+    else
+    {
+        memcpy(mem + begin, data + begin, end - begin);
+    }
+    return 1;
+}
+
+inline int load_snapshot(Vm& vm, const uint8_t* file, size_t size);
+
+enum image_kind { IMAGE_OBJ, IMAGE_NATIVE, IMAGE_SNAPSHOT, IMAGE_ASM };
+
+/* one file of a load plan, mapped read only */
+struct image_file
+{
+    std::string path;
+    int fd = -1;
+    const uint8_t* file = NULL;
+    size_t size = 0;
+    image_kind kind = IMAGE_OBJ;
+    uint32_t begin = 0; /* the words it covers, a snapshot covers them all */
+    uint32_t end = 0;
+    asm_image assembled; /* a source, assembled while planning */
+};
+
+/* images that load together. every file is opened and every range known
+   before a byte is copied, so overlaps can be turned down up front */
+struct image_plan
+{
+    std::vector<image_file> images;
+    size_t failed = SIZE_MAX;                   /* the first file that could not be read */
+    size_t overlap[2] = { SIZE_MAX, SIZE_MAX }; /* two files covering the same words */
+
+    image_plan() {}
+    image_plan(const image_plan&) = delete;
+    image_plan& operator=(const image_plan&) = delete;
+    ~image_plan()
+    {
+        for (image_file& f : images)
+        {
+            if (f.file) { munmap((void*)f.file, f.size); }
+            if (f.fd >= 0) { close(f.fd); }
+        }
+    }
+};
+
+/* runs body(i) for every i < n on up to threads threads, 0 for one per core */
+template <class F>
+inline void parallel_for(size_t n, unsigned threads, F body)
+{
+    if (threads == 0) { threads = std::thread::hardware_concurrency(); }
+    if (threads > n) { threads = n; }
+    std::atomic<size_t> next{0};
+    auto work = [&] {
+        for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < n;) { body(i); }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) { pool.emplace_back(work); }
+    work();
+    for (std::thread& t : pool) { t.join(); }
+}
+
+/* maps one file and works out where it goes, 0 if it cannot be loaded */
+inline int plan_image(image_file& f)
+{
+    f.fd = open(f.path.c_str(), O_RDONLY);
+    if (f.fd < 0) { return 0; }
+    struct stat st;
+    if (fstat(f.fd, &st) != 0 || st.st_size < 2) { return 0; }
+    void* file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, f.fd, 0);
+    if (file == MAP_FAILED) { return 0; }
+    f.file = (const uint8_t*)file;
+    f.size = st.st_size;
+    /* start reading the rest while the other files are planned */
+    madvise(file, f.size, MADV_WILLNEED);
+
+    if (asm_source(f.path))
+    {
+        if (!assemble((const char*)f.file, f.size, f.assembled)) { return 0; }
+        f.kind = IMAGE_ASM;
+        f.begin = f.assembled.origin;
+        f.end = f.begin + f.assembled.words.size();
+    }
+    else if (f.size >= IMAGE_PAGE && memcmp(f.file, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) == 0)
+    {
+        image_header h;
+        memcpy(&h, f.file, sizeof(h));
+        size_t begin = 2 * (size_t)h.origin;
+        size_t end = begin + 2 * (size_t)h.count;
+        if (end > MEMORY_SIZE || f.size < IMAGE_PAGE + end - begin + begin % IMAGE_PAGE) { return 0; }
+        f.kind = IMAGE_NATIVE;
+        f.begin = h.origin;
+        f.end = h.origin + h.count;
+    }
+    else if (f.size >= sizeof(SNAPSHOT_MAGIC) && memcmp(f.file, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0)
+    {
+        f.kind = IMAGE_SNAPSHOT;
+        f.begin = 0;
+        f.end = UINT16_MAX + 1;
+    }
+    else
+    {
+        uint32_t count = (f.size - 2) / 2;
+        f.kind = IMAGE_OBJ;
+        f.begin = swap16(*(const uint16_t*)f.file);
+        f.end = f.begin + count < UINT16_MAX + 1 ? f.begin + count : UINT16_MAX + 1;
+    }
+    return 1;
+}
+
+/* 1 when every file can be loaded and none of them overlap */
+inline int plan_images(image_plan& plan, const std::vector<std::string>& paths, unsigned threads = 0)
+{
+    plan.images.resize(paths.size());
+    std::vector<char> ok(paths.size());
+    parallel_for(paths.size(), threads, [&](size_t i) {
+        plan.images[i].path = paths[i];
+        ok[i] = plan_image(plan.images[i]);
+    });
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        if (!ok[i])
+        {
+            plan.failed = i;
+            return 0;
+        }
+    }
+
+    /* sorted by where they start, an image overlaps the one reaching furthest before it */
+    std::vector<size_t> order(paths.size());
+    for (size_t i = 0; i < order.size(); ++i) { order[i] = i; }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return plan.images[a].begin < plan.images[b].begin;
+    });
+    size_t reach = SIZE_MAX;
+    for (size_t i : order)
+    {
+        const image_file& f = plan.images[i];
+        if (f.begin == f.end) { continue; }
+        if (reach != SIZE_MAX && f.begin < plan.images[reach].end)
+        {
+            plan.overlap[0] = reach < i ? reach : i;
+            plan.overlap[1] = reach < i ? i : reach;
+            return 0;
+        }
+        if (reach == SIZE_MAX || f.end > plan.images[reach].end) { reach = i; }
+    }
+    return 1;
+}
+
+/* why a plan was turned down, or why loading it failed */
+inline std::string plan_error(const image_plan& plan)
+{
+    if (plan.failed != SIZE_MAX)
+    {
+        const image_file& f = plan.images[plan.failed];
+        return "failed to load image: " + f.path + (f.assembled.error.empty() ? "" : ": " + f.assembled.error);
+    }
+    if (plan.overlap[0] == SIZE_MAX) { return "failed to load images"; }
+    const image_file& a = plan.images[plan.overlap[0]];
+    const image_file& b = plan.images[plan.overlap[1]];
+    char range[48];
+    snprintf(range, sizeof(range), "images overlap at x%04X-x%04X: ", std::max(a.begin, b.begin),
+             std::min(a.end, b.end) - 1);
+    return range + a.path + " and " + b.path;
+}
+
+inline int load_planned(Vm& vm, const image_file& f)
+{
+    switch (f.kind)
+    {
+        case IMAGE_NATIVE: return load_native_image(vm, f.fd, f.file, f.size);
+        case IMAGE_SNAPSHOT: return load_snapshot(vm, f.file, f.size);
+        case IMAGE_ASM: return asm_copy(vm, f.assembled);
+        default: return load_obj_image(vm, f.file, f.size);
+    }
+}
+
+/* copies straight from the mapped files, in parallel when no two of them
+   touch the same words. with overlaps they go in order and later images win */
+inline int Vm::load_images(const image_plan& plan, unsigned threads)
+{
+    if (plan.failed != SIZE_MAX) { return 0; }
+    size_t n = plan.images.size();
+    std::vector<char> ok(n);
+    if (plan.overlap[0] != SIZE_MAX) { threads = 1; }
+    parallel_for(n, threads, [&](size_t i) { ok[i] = load_planned(*this, plan.images[i]); });
+
+    /* the images may replace code that already ran */
+    decode_cache_reset(*this);
+    if (jit) { jit_flush(*jit); }
+    for (char loaded : ok)
+    {
+        if (!loaded) { return 0; }
+    }
+    return 1;
+}
+
+inline int Vm::load_image(const char* image_path)
+{
+    image_plan plan;
+    plan_images(plan, { image_path }, 1);
+    return load_images(plan, 1);
+}
+
+/* OS Image */
+/* the OS from docs/supplies, built in so booting it reads no file. traps
+   then go through its vector table like on the real machine, except that
+   GETC..HALT still run natively as long as their vectors point at the OS's
+   own handlers. a guest that installs its own handler gets it */
+enum
+{
+    OS_START = 0x0200,
+    OS_BAD_TRAP = 0x0264,   /* every vector os.asm leaves undefined */
+    OS_BAD_INT = 0x0265,
+    MR_DSR = 0xFE04,        /* display status */
+    MR_DDR = 0xFE06,        /* display data */
+    MR_MCR = 0xFFFE         /* machine control, clearing bit 15 halts */
+};
+
+/* where os.asm puts GETC, OUT, PUTS, IN, PUTSP and HALT */
+const uint16_t os_trap_handlers[] = { 0x021D, 0x0221, 0x0227, 0x0234, 0x0240, 0x025F };
+
+/* docs/supplies/os.asm assembled, from OS_START on */
+const uint16_t os_code[] = {
+    0x201A, 0xB00A, 0x2017, 0xB007, 0x2E17, 0xC1C1, 0xFE00, 0xFE02,
+    0xFE04, 0xFE06, 0xFE08, 0xFE0A, 0xFE12, 0xFFFE, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x7FFF, 0x00FF, 0x0028, 0xFFFF, 0x3000, 0xA1E8, 0x07FE, 0xA1E7,
+    0xC1C0, 0x33F4, 0xA3E5, 0x07FE, 0xB1E4, 0x23F0, 0xC1C0, 0x31E6,
+    0x33E6, 0x3FEB, 0x1220, 0x6040, 0x0403, 0xF021, 0x1261, 0x0FFB,
+    0x21DD, 0x23DD, 0x2FE2, 0xC1C0, 0x3FE2, 0xE030, 0xF022, 0xF020,
+    0xF021, 0x31D4, 0x5020, 0x102A, 0xF021, 0x21D0, 0x2FD8, 0xC1C0,
+    0x31CD, 0x33CD, 0x35CD, 0x37CD, 0x3FD0, 0x1220, 0x6440, 0x21D1,
+    0x5002, 0x040F, 0xF021, 0x5020, 0x1628, 0x1000, 0x14A0, 0x0601,
+    0x1021, 0x1482, 0x16FF, 0x03F9, 0x1020, 0x0403, 0xF021, 0x1261,
+    0x0FED, 0x21B4, 0x23B4, 0x25B4, 0x27B4, 0x2FB7, 0xC1C0, 0xA1AD,
+    0x23B7, 0x5001, 0xB1AA, 0x0F9C, 0x0FFA, 0x8000, 0x000A, 0x0049,
+    0x006E, 0x0070, 0x0075, 0x0074, 0x0020, 0x0061, 0x0020, 0x0063,
+    0x0068, 0x0061, 0x0072, 0x0061, 0x0063, 0x0074, 0x0065, 0x0072,
+    0x003E, 0x0020, 0x0000,
+};
+
+inline bool os_native_trap(const Vm& vm, uint8_t vector)
+{
+    return vector >= TRAP_GETC && vector <= TRAP_HALT
+        && vm.memory[vector] == os_trap_handlers[vector - TRAP_GETC];
+}
+
+/* the display never makes the OS wait */
+inline uint16_t console_read(Vm& vm, uint16_t address)
+{
+    if (address == MR_DSR) { return 1 << 15; }
+    return keyboard_read(vm, address);
+}
+
+inline void console_write(Vm& vm, uint16_t address, uint16_t val)
+{
+    if (address == MR_DDR)
+    {
+        char c = (char)val;
+        vm.io->put(&c, 1);
+    }
+    else
+    {
+        keyboard_write(vm, address, val);
+    }
+}
+
+inline void machine_control_write(Vm& vm, uint16_t address, uint16_t val)
+{
+    if (address == MR_MCR && !(val >> 15))
+    {
+        vm.io->flush();
+        vm.running = false;
+    }
+}
+
+inline uint16_t display_read(Vm& vm, uint16_t address);
+inline void display_write(Vm& vm, uint16_t address, uint16_t val);
+
+inline void os_devices(Vm& vm)
+{
+    if (vm.display)
+    {
+        vm.device_map(MR_KBSR >> 8, display_read, display_write);
+    }
+    else
+    {
+        vm.device_map(MR_KBSR >> 8, console_read, console_write);
+    }
+    vm.device_map(MR_MCR >> 8, NULL, machine_control_write);
+}
+
+inline void Vm::boot_os()
+{
+    for (int v = 0; v < 0x100; ++v)
+    {
+        memory[v] = OS_BAD_TRAP;
+        memory[0x100 + v] = OS_BAD_INT;
+    }
+    memcpy(memory + TRAP_GETC, os_trap_handlers, sizeof(os_trap_handlers));
+    memcpy(memory + OS_START, os_code, sizeof(os_code));
+    os_devices(*this);
+    os = true;
+    decode_cache_reset(*this);
+    if (jit) { jit_flush(*jit); }
+    reset(OS_START);
+}
+
+/* Display */
+/* an optional 80x24 text screen the guest draws with plain stores. MR_VROW
+   picks the row that shows through the window at MR_VRAM, one cell a word
+   with the character in the low byte. stores only mark rows dirty, the
+   changed cells go out as one burst of ANSI escapes per frame */
+enum
+{
+    MR_VCR = 0xFE14,   /* display control, bit 15 turns it on, clear of os.asm's */
+    MR_VROW = 0xFE16,  /* the row in the window */
+    MR_VRAM = 0xFE80,  /* the window, DISPLAY_COLS cells */
+    DISPLAY_COLS = 80,
+    DISPLAY_ROWS = 24
+};
+
+struct display_state
+{
+    char cells[DISPLAY_ROWS][DISPLAY_COLS];
+    char shown[DISPLAY_ROWS][DISPLAY_COLS]; /* what the terminal has */
+    uint32_t dirty = 0;                     /* one bit per row */
+    uint16_t row = 0;
+    bool on = false;
+    std::chrono::nanoseconds period{std::chrono::milliseconds(16)};
+    std::chrono::steady_clock::time_point last;
+    uint64_t frames = 0;
+
+    display_state()
+    {
+        memset(cells, ' ', sizeof(cells));
+        memset(shown, ' ', sizeof(shown));
+    }
+};
+
+/* sends the cells that changed since the last frame. a short run of
+   unchanged cells is cheaper to resend than to jump over */
+inline void display_present(Vm& vm)
+{
+    display_state& d = *vm.display;
+    std::string burst;
+    char move[32];
+    for (int r = 0; r < DISPLAY_ROWS; ++r)
+    {
+        if (!(d.dirty >> r & 1)) { continue; }
+        int c = 0;
+        while (c < DISPLAY_COLS)
+        {
+            if (d.cells[r][c] == d.shown[r][c])
+            {
+                ++c;
+                continue;
+            }
+            int end = c + 1;
+            for (int same = 0; end < DISPLAY_COLS && same < 6; ++end)
+            {
+                same = d.cells[r][end] == d.shown[r][end] ? same + 1 : 0;
+            }
+            while (d.cells[r][end - 1] == d.shown[r][end - 1]) { --end; }
+            snprintf(move, sizeof(move), "\x1b[%d;%dH", r + 1, c + 1);
+            burst += move;
+            burst.append(d.cells[r] + c, end - c);
+            memcpy(d.shown[r] + c, d.cells[r] + c, end - c);
+            c = end;
+        }
+    }
+    d.dirty = 0;
+    d.last = std::chrono::steady_clock::now();
+    if (burst.empty()) { return; }
+    ++d.frames;
+    vm.io->put(burst.data(), burst.size());
+}
+
+/* a frame at most every period while the guest is busy drawing */
+inline void display_tick(Vm& vm)
+{
+    display_state& d = *vm.display;
+    if (d.dirty && std::chrono::steady_clock::now() - d.last >= d.period) { display_present(vm); }
+}
+
+/* draws what is left and hands the terminal back below the screen */
+inline void display_close(Vm& vm)
+{
+    display_state& d = *vm.display;
+    if (d.dirty) { display_present(vm); }
+    if (!d.on) { return; }
+    char end[32];
+    int n = snprintf(end, sizeof(end), "\x1b[%d;1H\x1b[?25h", DISPLAY_ROWS + 1);
+    vm.io->put(end, n);
+    d.on = false;
+}
+
+/* text from a TRAP lands after the frame drawn so far */
+inline void display_trap(Vm& vm, uint8_t vector)
+{
+    if (vector == TRAP_HALT) { display_close(vm); }
+    else if (vm.display->dirty) { display_present(vm); }
+}
+
+inline uint16_t display_read(Vm& vm, uint16_t address)
+{
+    /* a guest waiting for a key has finished its frame */
+    if (address == MR_KBSR && vm.display->dirty && !vm.io->ready()) { display_present(vm); }
+    return vm.os ? console_read(vm, address) : keyboard_read(vm, address);
+}
+
+inline void display_write(Vm& vm, uint16_t address, uint16_t val)
+{
+    display_state& d = *vm.display;
+    if (address >= MR_VRAM && address < MR_VRAM + DISPLAY_COLS)
+    {
+        char c = (char)(val & 0xFF);
+        d.cells[d.row][address - MR_VRAM] = c ? c : ' ';
+        d.dirty |= 1u << d.row;
+    }
+    else if (address == MR_VROW)
+    {
+        d.row = val % DISPLAY_ROWS;
+        for (int c = 0; c < DISPLAY_COLS; ++c) { vm.memory[MR_VRAM + c] = (uint8_t)d.cells[d.row][c]; }
+        display_tick(vm);
+    }
+    else if (address == MR_VCR)
+    {
+        bool on = val >> 15;
+        if (on && !d.on)
+        {
+            vm.io->put("\x1b[?25l\x1b[2J", 10);
+            memset(d.shown, ' ', sizeof(d.shown));
+            d.dirty = (1u << DISPLAY_ROWS) - 1;
+            d.on = true;
+        }
+        else if (!on)
+        {
+            display_close(vm);
+        }
+    }
+    else if (vm.os)
+    {
+        if (address == MR_DDR && d.dirty) { display_present(vm); }
+        console_write(vm, address, val);
+    }
+    else
+    {
+        keyboard_write(vm, address, val);
+    }
+}
+
+inline display_state& Vm::enable_display()
+{
+    if (!display)
+    {
+        display = new display_state;
+        device_map(MR_KBSR >> 8, display_read, display_write);
+    }
+    return *display;
+}
+
+/* Decode C++ */
+/* the same step masks as ins, but the work is done once per address */
+template <unsigned op>
+void decode(uint16_t pc, uint16_t instr, decoded& d)
+{
+    constexpr uint16_t opbit = (1 << op);
+    d.instr = instr;
+    if (0x4EEE & opbit) { d.r0 = (instr >> 9) & 0x7; }
+    if (0x12F3 & opbit) { d.r1 = (instr >> 6) & 0x7; }
+    if (0x0022 & opbit)
+    {
+        d.imm_flag = (instr >> 5) & 0x1;
+
+        if (d.imm_flag)
+        {
+            d.imm5 = sign_extend(instr & 0x1F, 5);
+        }
+        else
+        {
+            d.r2 = instr & 0x7;
+        }
+    }
+    if (0x00C0 & opbit) { d.base_off = sign_extend(instr & 0x3F, 6); }
+    if (0x4C0D & opbit) { d.pc_plus_off = pc + sign_extend(instr & 0x1FF, 9); }
+    if (0x0001 & opbit) { d.cond = (instr >> 9) & 0x7; } // BR
+    if (0x0010 & opbit)  // JSR
+    {
+        d.long_flag = (instr >> 11) & 1;
+        if (d.long_flag) { d.pc_plus_off = pc + sign_extend(instr & 0x7FF, 11); }
+    }
+}
+
+static void (*decode_table[16])(uint16_t, uint16_t, decoded&) = {
+    decode<0>, decode<1>, decode<2>, decode<3>,
+    decode<4>, decode<5>, decode<6>, decode<7>,
+    decode<8>, decode<9>, decode<10>, decode<11>,
+    decode<12>, decode<13>, decode<14>, decode<15>
+};
+
+/* Profiler */
+/* counts for a profiled run. every instruction is charged to the opcode,
+   the address it was fetched from, and the call stack it ran in. calls are
+   JSR/JSRR and returns are JMP R7 back to an address a call left in R7 */
+enum
+{
+    PROFILE_DEPTH = 256,        /* deeper calls are treated as plain jumps */
+    PROFILE_TRAP_FRAME = 0x10000 /* frame keys above this are TRAP vectors */
+};
+
+struct profile_frame
+{
+    uint32_t parent;
+    uint32_t key;  /* subroutine address, or PROFILE_TRAP_FRAME | vector */
+    uint64_t self; /* instructions run here and not in a callee */
+};
+
+struct profile_state
+{
+    uint64_t ops[16] = {};
+    uint64_t pcs[UINT16_MAX + 1] = {};
+    uint64_t traps[256] = {};
+    uint64_t mmio_reads[0x10000 - DEVICE_BASE] = {};
+
+    std::vector<profile_frame> frames;
+    std::map<uint64_t, uint32_t> children; /* parent << 32 | key to frame */
+    std::vector<std::pair<uint32_t, uint16_t>> calls; /* caller frame and return address */
+    uint32_t frame = 0;
+
+    explicit profile_state(uint16_t entry) { frames.push_back({ 0, entry, 0 }); }
+};
+
+inline uint32_t profile_child(profile_state& p, uint32_t key)
+{
+    auto it = p.children.emplace((uint64_t)p.frame << 32 | key, (uint32_t)p.frames.size()).first;
+    if (it->second == p.frames.size()) { p.frames.push_back({ p.frame, key, 0 }); }
+    return it->second;
+}
+
+inline void profile_step(profile_state& p, unsigned op, uint16_t pc)
+{
+    ++p.ops[op];
+    ++p.pcs[pc];
+    if (op != OP_TRAP) { ++p.frames[p.frame].self; }
+}
+
+inline void profile_call(profile_state& p, uint16_t target, uint16_t ret)
+{
+    if (p.calls.size() == PROFILE_DEPTH) { return; }
+    p.calls.push_back({ p.frame, ret });
+    p.frame = profile_child(p, target);
+}
+
+/* a return may skip frames that never returned, unwind to the one it matches */
+inline void profile_return(profile_state& p, uint16_t target)
+{
+    for (size_t i = p.calls.size(); i-- > 0;)
+    {
+        if (p.calls[i].second == target)
+        {
+            p.frame = p.calls[i].first;
+            p.calls.resize(i);
+            return;
+        }
+    }
+}
+
+inline void profile_trap(profile_state& p, uint8_t vector)
+{
+    ++p.traps[vector];
+    ++p.frames[profile_child(p, PROFILE_TRAP_FRAME | vector)].self;
+}
+
+inline const char* profile_trap_name(unsigned vector)
+{
+    static const char* names[] = { "GETC", "OUT", "PUTS", "IN", "PUTSP", "HALT" };
+    return vector >= TRAP_GETC && vector <= TRAP_HALT ? names[vector - TRAP_GETC] : NULL;
+}
+
+inline std::string profile_frame_name(uint32_t key)
+{
+    char name[32];
+    if (key & PROFILE_TRAP_FRAME)
+    {
+        const char* trap = profile_trap_name(key & 0xFF);
+        if (trap) { snprintf(name, sizeof(name), "TRAP_%s", trap); }
+        else { snprintf(name, sizeof(name), "TRAP_x%02X", (unsigned)(key & 0xFF)); }
+    }
+    else
+    {
+        snprintf(name, sizeof(name), "x%04X", (unsigned)key);
+    }
+    return name;
+}
+
+/* one line per stack, in the folded format flamegraph.pl reads. the
+   weight is instructions, so the graph shows where the guest spends them */
+inline void profile_write_folded(const profile_state& p, FILE* out)
+{
+    for (const profile_frame& f : p.frames)
+    {
+        if (f.self == 0) { continue; }
+        std::string stack = profile_frame_name(f.key);
+        for (const profile_frame* up = &f; up != &p.frames[0];)
+        {
+            up = &p.frames[up->parent];
+            stack = profile_frame_name(up->key) + ";" + stack;
+        }
+        fprintf(out, "%s %llu\n", stack.c_str(), (unsigned long long)f.self);
+    }
+}
+
+/* the hottest opcodes and addresses, and every TRAP and device register used */
+inline void profile_report(const profile_state& p, FILE* out, size_t top = 20)
+{
+    static const char* op_names[16] = {
+        "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+        "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+    };
+    uint64_t total = 0;
+    for (uint64_t n : p.ops) { total += n; }
+    double scale = total ? 100.0 / total : 0;
+
+    fprintf(out, "profile: %llu instructions\n", (unsigned long long)total);
+    int ops[16];
+    for (int i = 0; i < 16; ++i) { ops[i] = i; }
+    std::sort(ops, ops + 16, [&](int a, int b) { return p.ops[a] > p.ops[b]; });
+    for (int op : ops)
+    {
+        if (!p.ops[op]) { break; }
+        fprintf(out, "  %-5s %14llu %6.2f%%\n", op_names[op], (unsigned long long)p.ops[op], p.ops[op] * scale);
+    }
+
+    std::vector<uint16_t> pcs;
+    for (uint32_t a = 0; a <= UINT16_MAX; ++a)
+    {
+        if (p.pcs[a]) { pcs.push_back(a); }
+    }
+    size_t shown = pcs.size() < top ? pcs.size() : top;
+    std::partial_sort(pcs.begin(), pcs.begin() + shown, pcs.end(),
+                      [&](uint16_t a, uint16_t b) { return p.pcs[a] > p.pcs[b]; });
+    fprintf(out, "hottest addresses:\n");
+    for (size_t i = 0; i < shown; ++i)
+    {
+        fprintf(out, "  x%04X %14llu %6.2f%%\n", pcs[i], (unsigned long long)p.pcs[pcs[i]], p.pcs[pcs[i]] * scale);
+    }
+
+    fprintf(out, "traps:\n");
+    for (unsigned v = 0; v < 256; ++v)
+    {
+        if (p.traps[v]) { fprintf(out, "  %-10s %14llu\n", profile_frame_name(PROFILE_TRAP_FRAME | v).c_str(), (unsigned long long)p.traps[v]); }
+    }
+    fprintf(out, "device reads:\n");
+    for (unsigned a = 0; a < 0x10000 - DEVICE_BASE; ++a)
+    {
+        if (p.mmio_reads[a]) { fprintf(out, "  x%04X %14llu\n", a + DEVICE_BASE, (unsigned long long)p.mmio_reads[a]); }
+    }
+}
+
+/* Engine Policies */
+/* the handlers are built for one kind of machine at a time. a policy says
+   how loads and stores reach memory, what is counted on the way and which
+   backend TRAPs talk to, and ins compiles in only what it names, so a
+   machine pays nothing on the hot path for what it does not use. all of
+   them keep the condition codes lazy, see cpu_state, an eager build would
+   only add work to every instruction that sets them */
+
+/* devices behind DEVICE_BASE and compiled code to drop, see mem_write.
+   devices says a store can reach a device, which may stop the machine */
+struct mmio_memory
+{
+    static const bool devices = true;
+    static uint16_t read(Vm& vm, uint16_t address) { return vm.mem_read(address); }
+    static void write(Vm& vm, uint16_t address, uint16_t val) { vm.mem_write(address, val); }
+};
+
+/* no device page has a handler and nothing is compiled, so device space
+   is plain memory and a store only has the decode cache to keep right */
+struct flat_memory
+{
+    static const bool devices = false;
+    static uint16_t read(Vm& vm, uint16_t address) { return vm.memory[address]; }
+    static void write(Vm& vm, uint16_t address, uint16_t val)
+    {
+        vm.memory[address] = val;
+        vm.dirty[address >> 14] |= (uint64_t)1 << (address >> 8 & 63);
+        decode_cache_invalidate(vm, address);
+    }
+};
+
+/* faults says whether a probe can stop the machine from its fault hook,
+   which the reserved opcode and RTI in user mode call before they raise
+   their exception */
+struct no_probe
+{
+    static const bool faults = false;
+    static void step(Vm&, unsigned, uint16_t) {}
+    static void read(Vm&, uint16_t) {}
+    static void call(Vm&, uint16_t, uint16_t) {}
+    static void ret(Vm&, uint16_t) {}
+    static void trap(Vm&, uint8_t) {}
+    static void edge(Vm&, uint16_t) {}  /* after a BR, JMP or JSR, with the new PC */
+    static void fault(Vm&, uint8_t) {}  /* before the exception of that vector */
+};
+
+/* the counts of enable_profile */
+struct profile_probe : no_probe
+{
+    static void step(Vm& vm, unsigned op, uint16_t pc) { profile_step(*vm.profile, op, pc); }
+    static void read(Vm& vm, uint16_t address)
+    {
+        if (address >= DEVICE_BASE) { ++vm.profile->mmio_reads[address - DEVICE_BASE]; }
+    }
+    static void call(Vm& vm, uint16_t target, uint16_t back) { profile_call(*vm.profile, target, back); }
+    static void ret(Vm& vm, uint16_t target) { profile_return(*vm.profile, target); }
+    static void trap(Vm& vm, uint8_t vector) { profile_trap(*vm.profile, vector); }
+};
+
+/* whatever vm.io is, through its vtable */
+struct any_io
+{
+    static vm_io& get(Vm& vm) { return *vm.io; }
+};
+
+/* vm.io is known to be a T. the backends are final, so its calls are
+   direct and the small ones inline */
+template <class T>
+struct fixed_io
+{
+    static T& get(Vm& vm) { return static_cast<T&>(*vm.io); }
+};
+
+template <class Memory, class Probe, class Io>
+struct engine_policy
+{
+    typedef Memory memory;
+    typedef Probe probe;
+    typedef Io io;
+};
+
+/* what a Vm is as it comes, and what the engines fall back on */
+typedef engine_policy<mmio_memory, no_probe, any_io> plain_policy;
+typedef engine_policy<mmio_memory, profile_probe, any_io> profile_policy;
+/* a replay unmaps the devices and takes what they did from the trace */
+typedef engine_policy<flat_memory, no_probe, any_io> replay_policy;
+
+template <class P>
+inline uint16_t policy_read(Vm& vm, uint16_t address)
+{
+    P::probe::read(vm, address);
+    return P::memory::read(vm, address);
+}
+
+/* Instruction C++ Decoded */
+template <unsigned op, class P = plain_policy>
+void ins(Vm& vm, const decoded& d)
+{
+    uint16_t* reg = vm.cpu.reg;
+    uint16_t instr = d.instr;
+    uint16_t r0 = d.r0, r1 = d.r1;
+    uint16_t pc_plus_off = d.pc_plus_off, base_plus_off;
+
+    constexpr uint16_t opbit = (1 << op);
+    P::probe::step(vm, op, reg[R_PC] - 1);
+    if (0x00C0 & opbit)
+    {   // Base + offset
+        base_plus_off = reg[r1] + d.base_off;
+    }
+    if (0x0001 & opbit)
+    {
+        // BR
+        if (d.cond & cond_flags(vm.cpu)) { reg[R_PC] = pc_plus_off; }
+        P::probe::edge(vm, reg[R_PC]);
+    }
+    if (0x0002 & opbit)  // ADD
+    {
+        if (d.imm_flag)
+        {
+            reg[r0] = reg[r1] + d.imm5;
+        }
+        else
+        {
+            reg[r0] = reg[r1] + reg[d.r2];
+        }
+    }
+    if (0x0020 & opbit)  // AND
+    {
+        if (d.imm_flag)
+        {
+            reg[r0] = reg[r1] & d.imm5;
+        }
+        else
+        {
+            reg[r0] = reg[r1] & reg[d.r2];
+        }
+    }
+    if (0x0200 & opbit) { reg[r0] = ~reg[r1]; } // NOT
+    if (0x1000 & opbit)  // JMP
+    {
+        reg[R_PC] = reg[r1];
+        if (instr & 1) { vm.cpu.psr |= PSR_USER; } // JMPT
+        if (r1 == R_R7) { P::probe::ret(vm, reg[R_PC]); }
+        P::probe::edge(vm, reg[R_PC]);
+    }
+    if (0x0010 & opbit)  // JSR
+    {
+        reg[R_R7] = reg[R_PC];
+        if (d.long_flag)
+        {
+            reg[R_PC] = pc_plus_off;
+        }
+        else
+        {
+            reg[R_PC] = reg[r1];
+        }
+        P::probe::call(vm, reg[R_PC], reg[R_R7]);
+        P::probe::edge(vm, reg[R_PC]);
+    }
+
+    if (0x0004 & opbit) { reg[r0] = policy_read<P>(vm, pc_plus_off); } // LD
+    if (0x0400 & opbit) { reg[r0] = policy_read<P>(vm, policy_read<P>(vm, pc_plus_off)); } // LDI
+    if (0x0040 & opbit) { reg[r0] = policy_read<P>(vm, base_plus_off); }  // LDR
+    if (0x4000 & opbit) { reg[r0] = pc_plus_off; } // LEA
+    if (0x0008 & opbit) { P::memory::write(vm, pc_plus_off, reg[r0]); } // ST
+    if (0x0800 & opbit) { P::memory::write(vm, policy_read<P>(vm, pc_plus_off), reg[r0]); } // STI
+    if (0x0080 & opbit) { P::memory::write(vm, base_plus_off, reg[r0]); } // STR
+    if (0x8000 & opbit)  // TRAP
+    {
+         P::probe::trap(vm, instr & 0xFF);
+         if (vm.metrics) { vm.metrics->traps[instr & 0xFF].add(1); }
+         if (vm.os && !os_native_trap(vm, instr & 0xFF))
+         {
+             reg[R_R7] = reg[R_PC];
+             reg[R_PC] = P::memory::read(vm, instr & 0xFF);
+         }
+         else
+         {
+             if (vm.display) { display_trap(vm, instr & 0xFF); }
+             /* TRAP C++ */
+             uint16_t* memory = vm.memory;
+             auto& io = P::io::get(vm);
+             switch (instr & 0xFF)
+             {
+                 case TRAP_GETC:
+                     /* TRAP GETC C++ */
+                     /* read a single ASCII char */
+                     reg[R_R0] = (uint16_t)io.getc();
+                     update_flags(vm, R_R0);
+
+                     break;
+                 case TRAP_OUT:
+                 {
+                     char c = (char)reg[R_R0];
+                     io.put(&c, 1);
+                     break;
+                 }
+                 case TRAP_PUTS:
+                     /* TRAP PUTS C++ */
+                     {
+                         /* one char per word, handed over in chunks */
+                         char buf[256];
+                         size_t n = 0;
+                         for (uint16_t a = reg[R_R0]; memory[a]; ++a)
+                         {
+                             buf[n++] = (char)memory[a];
+                             if (n == sizeof(buf))
+                             {
+                                 io.put(buf, n);
+                                 n = 0;
+                             }
+                         }
+                         io.put(buf, n);
+                     }
+
+                     break;
+                 case TRAP_IN:
+                     /* TRAP IN C++ */
+                     {
+                         io.put("Enter a character: ", 19);
+                         char c = io.getc();
+                         io.put(&c, 1);
+                         reg[R_R0] = (uint16_t)c;
+                         update_flags(vm, R_R0);
+                     }
+
+                     break;
+                 case TRAP_PUTSP:
+                     /* TRAP PUTSP C++ */
+                     {
+                         /* one char per byte (two bytes per word) */
+                         char buf[256];
+                         size_t n = 0;
+                         for (uint16_t a = reg[R_R0]; memory[a]; ++a)
+                         {
+                             buf[n++] = memory[a] & 0xFF;
+                             char char2 = memory[a] >> 8;
+                             if (char2) { buf[n++] = char2; }
+                             if (n >= sizeof(buf) - 1)
+                             {
+                                 io.put(buf, n);
+                                 n = 0;
+                             }
+                         }
+                         io.put(buf, n);
+                     }
+
+                     break;
+                 case TRAP_HALT:
+                     io.put("HALT\n", 5);
+                     io.flush();
+                     vm.running = false;
+                     break;
+             }
+
+         }
+    }
+    if (0x0100 & opbit)  // RTI
+    {
+        if (vm.cpu.psr & PSR_USER) { P::probe::fault(vm, INT_PRIVILEGE); }
+        interrupt_return(vm);
+    }
+    if (0x2000 & opbit)  // RES
+    {
+        P::probe::fault(vm, INT_ILLEGAL);
+        interrupt_enter(vm, INT_ILLEGAL, (vm.cpu.psr & PSR_PRIORITY) >> 8);
+    }
+    if (0x4666 & opbit) { vm.cpu.flag_result = reg[r0]; }
+}
+
+/* Superinstructions */
+/* pairs and triples compilers emit all the time run from one cache entry,
+   which pays one dispatch instead of two or three. the first entry holds
+   the first instruction and the ones after hold the rest, so a handler is
+   just the plain ones back to back and can never disagree with them */
+inline decoded& decode_address(Vm& vm, uint16_t address, decoded& tmp);
+
+template <unsigned a, unsigned b, class P = plain_policy>
+void ins_fused(Vm& vm, const decoded& d)
+{
+    ins<a, P>(vm, d);
+    vm.cpu.reg[R_PC]++;
+    ins<b, P>(vm, (&d)[1]);
+}
+
+template <unsigned a, unsigned b, unsigned c, class P = plain_policy>
+void ins_fused(Vm& vm, const decoded& d)
+{
+    ins<a, P>(vm, d);
+    vm.cpu.reg[R_PC]++;
+    ins<b, P>(vm, (&d)[1]);
+    vm.cpu.reg[R_PC]++;
+    ins<c, P>(vm, (&d)[2]);
+}
+
+struct superinstruction
+{
+    uint8_t op;
+    uint8_t len;
+    void (*fn)(Vm&, const decoded&);
+    bool (*match)(const uint16_t* instr);
+};
+
+const superinstruction superinstructions[] = {
+    /* AND R,R,#0 then ADD R,R,#imm, loading a constant */
+    { FUSE_CONST, 2, ins_fused<OP_AND, OP_ADD>, [](const uint16_t* i) {
+        return (i[0] >> 12) == OP_AND && (i[0] & 0x3F) == 0x20
+            && (i[1] >> 12) == OP_ADD && (i[1] & 0x20)
+            && ((i[1] >> 9) & 7) == ((i[0] >> 9) & 7) && ((i[1] >> 6) & 7) == ((i[0] >> 9) & 7);
+    } },
+    /* a loop counter */
+    { FUSE_ADD_BR, 2, ins_fused<OP_ADD, OP_BR>, [](const uint16_t* i) {
+        return (i[0] >> 12) == OP_ADD && (i[1] >> 12) == OP_BR;
+    } },
+    /* LD R,addr then JSRR R, calling through a pointer */
+    { FUSE_LD_JSRR, 2, ins_fused<OP_LD, OP_JSR>, [](const uint16_t* i) {
+        return (i[0] >> 12) == OP_LD && (i[1] >> 12) == OP_JSR && !(i[1] & 0x800)
+            && ((i[1] >> 6) & 7) == ((i[0] >> 9) & 7);
+    } },
+    /* LDR R,B,off then ADD R,R,x then STR R,B,off, updating a field */
+    { FUSE_RMW, 3, ins_fused<OP_LDR, OP_ADD, OP_STR>, [](const uint16_t* i) {
+        return (i[0] >> 12) == OP_LDR && (i[1] >> 12) == OP_ADD && (i[2] >> 12) == OP_STR
+            && (i[2] & 0xFFF) == (i[0] & 0xFFF)
+            && ((i[1] >> 9) & 7) == ((i[0] >> 9) & 7) && ((i[1] >> 6) & 7) == ((i[0] >> 9) & 7);
+    } },
+};
+
+/* turns a freshly decoded entry into a superinstruction if the words after
+   it complete one. they are decoded into their own entries first */
+inline void fuse(Vm& vm, uint16_t address, decoded& e)
+{
+    const uint16_t* instr = vm.memory + address;
+    for (const superinstruction& s : superinstructions)
+    {
+        /* staying in the page also keeps it out of device space */
+        if ((address & 0xFFu) + s.len > DECODE_PAGE_WORDS || !s.match(instr)) { continue; }
+        decoded tmp;
+        for (unsigned k = 1; k < s.len; ++k)
+        {
+            if (vm.decode_cache[address + k].op == OP_DECODE) { decode_address(vm, address + k, tmp); }
+        }
+        e.fn = s.fn;
+        e.op = s.op;
+        e.len = s.len;
+        return;
+    }
+}
+
+/* Op Table Decoded */
+inline void debug_patch(Vm& vm, uint16_t address, decoded& e);
+inline void ins_break(Vm& vm, const decoded& d);
+
+static void (*op_table[16])(Vm&, const decoded&) = {
+    ins<0>, ins<1>, ins<2>, ins<3>,
+    ins<4>, ins<5>, ins<6>, ins<7>,
+    ins<8>, ins<9>, ins<10>, ins<11>,
+    ins<12>, ins<13>, ins<14>, ins<15>
+};
+
+/* fills the cache entry for an address */
+inline decoded& decode_address(Vm& vm, uint16_t address, decoded& tmp)
+{
+    uint16_t instr = vm.mem_read(address);
+    uint16_t op = instr >> 12;
+
+    /* the device registers change under us, never cache them */
+    decoded& e = address >= DEVICE_BASE ? tmp : decode_entry(vm, address);
+    decode_table[op](address + 1, instr, e);
+    if (vm.metrics) { vm.metrics->decodes.add(1); }
+    e.fn = op_table[op];
+    e.op = op;
+    e.len = 1;
+    if (&e == &tmp) { return e; }
+    if (vm.debug) { debug_patch(vm, address, e); }
+    else { fuse(vm, address, e); }
+    return e;
+}
+
+/* runs on the first fetch of an address, or after a store to it. whoever
+   dispatched here counted one instruction, so a superinstruction waits
+   for the next visit */
+inline void ins_decode(Vm& vm, const decoded& d)
+{
+    decoded tmp;
+    decoded& e = decode_address(vm, vm.cpu.reg[R_PC] - 1, tmp);
+    if (e.op == OP_BREAK) { ins_break(vm, e); }
+    else { op_table[e.instr >> 12](vm, e); }
+}
+
+/* Breakpoints */
+/* a debugger's breakpoints live in the decode cache: the entry of such an
+   address runs ins_break in place of its instruction, so the engines check
+   nothing on the way and every other instruction costs what it always did.
+   decode_address patches the entry again whenever it is decoded anew, and
+   makes no superinstructions while a debugger is attached, a fused entry
+   would run straight over the words after it */
+struct debug_state
+{
+    uint64_t breaks[0x10000 / 64] = {};
+    bool resume = false;  /* the next breakpoint reached lets its instruction run */
+    bool hit = false;     /* an engine stopped at one */
+};
+
+inline bool debug_has(const debug_state& g, uint16_t address)
+{
+    return g.breaks[address >> 6] >> (address & 63) & 1;
+}
+
+inline void debug_patch(Vm& vm, uint16_t address, decoded& e)
+{
+    if (!debug_has(*vm.debug, address)) { return; }
+    e.fn = ins_break;
+    e.op = OP_BREAK;
+    e.len = 1;
+}
+
+/* false when the breakpoint is the one the debugger resumes from. the
+   engines stop as they do on HALT, and the debugger starts them again */
+inline bool debug_stop(Vm& vm)
+{
+    debug_state& g = *vm.debug;
+    if (g.resume)
+    {
+        g.resume = false;
+        return false;
+    }
+    g.hit = true;
+    vm.running = false;
+    return true;
+}
+
+/* the instruction does not run, so the PC goes back to it, and the
+   engine that dispatched here counted it */
+inline void ins_break(Vm& vm, const decoded& d)
+{
+    if (!debug_stop(vm))
+    {
+        op_table[d.instr >> 12](vm, d);
+        return;
+    }
+    --vm.cpu.reg[R_PC];
+    --vm.cpu.cycles;
+}
+
+/* sets or clears the breakpoint at address, 0 in device space, where
+   nothing is cached */
+inline int debug_break(Vm& vm, uint16_t address, bool on)
+{
+    if (address >= DEVICE_BASE) { return 0; }
+    debug_state& g = vm.enable_debug();
+    uint64_t bit = (uint64_t)1 << (address & 63);
+    if (on) { g.breaks[address >> 6] |= bit; }
+    else { g.breaks[address >> 6] &= ~bit; }
+    decode_cache_invalidate(vm, address);
+    return 1;
+}
+
+/* Threaded Dispatch */
+#if LC3_THREADED
+template <class P>
+inline uint64_t run_threaded(Vm& vm, uint64_t n)
+{
+    static const void* labels[OP_BREAK + 1] = {
+        &&op_0, &&op_1, &&op_2, &&op_3,
+        &&op_4, &&op_5, &&op_6, &&op_7,
+        &&op_8, &&op_9, &&op_10, &&op_11,
+        &&op_12, &&op_13, &&op_14, &&op_15,
+        &&op_decode, &&fuse_const, &&fuse_add_br, &&fuse_ld_jsrr,
+        &&fuse_rmw, &&op_break
+    };
+    uint16_t* reg = vm.cpu.reg;
+    const decoded* cache = vm.decode_cache;
+    const decoded* d;
+    decoded tmp;
+    uint64_t left = n;
+
+    /* a probe that catches faults can stop the machine in any handler */
+#define DISPATCH() if (left == 0 || (P::probe::faults && !vm.running)) { goto done; } \
+    --left; d = &cache[reg[R_PC]++]; goto *labels[d->op]
+    /* and a store to MCR can, once it reaches the devices */
+#define STORED() if (P::memory::devices && !vm.running) { goto done; }
+    DISPATCH();
+
+op_0: ins<0, P>(vm, *d); DISPATCH();
+op_1: ins<1, P>(vm, *d); DISPATCH();
+op_2: ins<2, P>(vm, *d); DISPATCH();
+op_3: ins<3, P>(vm, *d); STORED(); DISPATCH();
+op_4: ins<4, P>(vm, *d); DISPATCH();
+op_5: ins<5, P>(vm, *d); DISPATCH();
+op_6: ins<6, P>(vm, *d); DISPATCH();
+op_7: ins<7, P>(vm, *d); STORED(); DISPATCH();
+op_8: ins<8, P>(vm, *d); DISPATCH();
+op_9: ins<9, P>(vm, *d); DISPATCH();
+op_10: ins<10, P>(vm, *d); DISPATCH();
+op_11: ins<11, P>(vm, *d); STORED(); DISPATCH();
+op_12: ins<12, P>(vm, *d); DISPATCH();
+op_13: ins<13, P>(vm, *d); DISPATCH();
+op_14: ins<14, P>(vm, *d); DISPATCH();
+op_15:
+    ins<15, P>(vm, *d);
+    if (!vm.running) { goto done; }
+    DISPATCH();
+op_decode:
+    d = &decode_address(vm, reg[R_PC] - 1, tmp);
+    if (d->op == OP_BREAK) { goto op_break; }
+    goto *labels[d->instr >> 12];
+op_break:
+    ins_break(vm, *d);
+    if (!vm.running) { goto done; }
+    DISPATCH();
+/* the rest of a superinstruction may not fit in what is left */
+#define FUSED(n) if (left < n - 1) { goto *labels[d->instr >> 12]; } left -= n - 1
+fuse_const: FUSED(2); ins_fused<OP_AND, OP_ADD, P>(vm, *d); DISPATCH();
+fuse_add_br: FUSED(2); ins_fused<OP_ADD, OP_BR, P>(vm, *d); DISPATCH();
+fuse_ld_jsrr: FUSED(2); ins_fused<OP_LD, OP_JSR, P>(vm, *d); DISPATCH();
+fuse_rmw: FUSED(3); ins_fused<OP_LDR, OP_ADD, OP_STR, P>(vm, *d); STORED(); DISPATCH();
+#undef FUSED
+#undef STORED
+#undef DISPATCH
+done:
+    return n - left;
+}
+#endif
+
+/* Run Interpreter */
+/* the handler of every op a cache entry can have, built for one policy.
+   an entry's fn is the plain one, the other builds go by its op */
+template <class P>
+struct engine_ops
+{
+    static void (*const table[OP_BREAK + 1])(Vm&, const decoded&);
+
+    static void run(Vm& vm, const decoded& d) { table[d.op](vm, d); }
+};
+
+/* ins_decode, going on with the handler of the same build */
+template <class P>
+void ins_decode_as(Vm& vm, const decoded& d)
+{
+    decoded tmp;
+    decoded& e = decode_address(vm, vm.cpu.reg[R_PC] - 1, tmp);
+    if (e.op == OP_BREAK) { ins_break(vm, e); }
+    else { engine_ops<P>::table[e.instr >> 12](vm, e); }
+}
+
+template <class P>
+void (*const engine_ops<P>::table[OP_BREAK + 1])(Vm&, const decoded&) = {
+    ins<0, P>, ins<1, P>, ins<2, P>, ins<3, P>,
+    ins<4, P>, ins<5, P>, ins<6, P>, ins<7, P>,
+    ins<8, P>, ins<9, P>, ins<10, P>, ins<11, P>,
+    ins<12, P>, ins<13, P>, ins<14, P>, ins<15, P>,
+    ins_decode_as<P>, ins_fused<OP_AND, OP_ADD, P>, ins_fused<OP_ADD, OP_BR, P>, ins_fused<OP_LD, OP_JSR, P>,
+    ins_fused<OP_LDR, OP_ADD, OP_STR, P>, ins_break
+};
+
+template <>
+inline void engine_ops<plain_policy>::run(Vm& vm, const decoded& d) { d.fn(vm, d); }
+
+/* runs at most n instructions and returns how many ran */
+template <class P>
+inline uint64_t run_interpreter(Vm& vm, uint64_t n)
+{
+#if LC3_THREADED
+    return run_threaded<P>(vm, n);
+#else
+    uint16_t* reg = vm.cpu.reg;
+    uint64_t left = n;
+    while (left && vm.running)
+    {
+        const decoded& d = vm.decode_cache[reg[R_PC]++];
+        unsigned len = d.len; /* ins_decode may fuse the entry under us */
+        if (len <= left)
+        {
+            engine_ops<P>::run(vm, d);
+            left -= len;
+        }
+        else
+        {
+            engine_ops<P>::table[d.instr >> 12](vm, d);
+            --left;
+        }
+    }
+    return n - left;
+#endif
+}
+
+/* the build for each backend that is final, the rest go through vm_io */
+template <class Memory>
+inline uint64_t (*engine_for(vm_io* io))(Vm& vm, uint64_t n)
+{
+    if (dynamic_cast<console_io*>(io)) { return run_interpreter<engine_policy<Memory, no_probe, fixed_io<console_io>>>; }
+    if (dynamic_cast<script_io*>(io)) { return run_interpreter<engine_policy<Memory, no_probe, fixed_io<script_io>>>; }
+    if (dynamic_cast<buffer_io*>(io)) { return run_interpreter<engine_policy<Memory, no_probe, fixed_io<buffer_io>>>; }
+    return run_interpreter<engine_policy<Memory, no_probe, any_io>>;
+}
+
+inline void Vm::specialize()
+{
+    bool flat = !jit;
+    for (const device_page& dev : devices) { flat = flat && !dev.read && !dev.write; }
+    engine = flat ? engine_for<flat_memory>(io) : engine_for<mmio_memory>(io);
+}
+
+/* Run Profiled */
+/* the same handlers built with counting in, one instruction at a time so
+   each is counted where it is. the default tables never see any of it */
+inline uint64_t run_profiled(Vm& vm, uint64_t n)
+{
+    uint16_t* reg = vm.cpu.reg;
+    decoded tmp;
+    uint64_t left = n;
+    while (left && vm.running)
+    {
+        const decoded* d = &vm.decode_cache[reg[R_PC]++];
+        if (d->op == OP_DECODE) { d = &decode_address(vm, reg[R_PC] - 1, tmp); }
+        engine_ops<profile_policy>::table[d->instr >> 12](vm, *d);
+        --left;
+    }
+    return n - left;
+}
+
+inline profile_state& Vm::enable_profile()
+{
+    if (!profile) { profile = new profile_state(cpu.reg[R_PC]); }
+    return *profile;
+}
+
+/* JIT */
+#if LC3_JIT
+/* basic blocks are compiled to x86-64 into one executable buffer per VM.
+   when it fills up, or a store lands on a page holding compiled code,
+   everything is thrown away and compiled again on demand. */
+enum
+{
+    JIT_BUFFER_SIZE = 1 << 22,
+    JIT_MAX_BLOCK = 64,                         /* instructions */
+    JIT_MAX_CODE = 128 * (JIT_MAX_BLOCK + 2),   /* bytes */
+    JIT_OVER_BUDGET = 1                         /* returned when a block would pass cpu.limit */
+};
+
+enum { JIT_CODE = 1, JIT_DEVICE = 2 };
+
+struct jit_state
+{
+    uint8_t* buffer; /* starts with the trampoline */
+    uint8_t* start;  /* first byte after the trampoline */
+    uint8_t* end;    /* next free byte */
+    unsigned epoch;  /* bumped on every flush, so stale links are never patched */
+
+    uint8_t* block[UINT16_MAX + 1];
+    uint8_t code_page[256];          /* quick filter for stores */
+    uint8_t code_word[UINT16_MAX + 1];
+};
+
+/* rdi = code, rsi = vm, rdx = cpu, rcx = memory, r8 = code_page */
+typedef uint8_t* (*jit_enter_fn)(uint8_t*, Vm*, cpu_state*, uint16_t*, uint8_t*);
+
+inline void jit_flush(jit_state& j)
+{
+    j.end = j.start;
+    memset(j.block, 0, sizeof(j.block));
+    memset(j.code_page, 0, sizeof(j.code_page));
+    memset(j.code_word, 0, sizeof(j.code_word));
+    for (int p = DEVICE_BASE >> 8; p < 256; ++p) { j.code_page[p] = JIT_DEVICE; }
+    ++j.epoch;
+}
+
+/* 1 if the word was compiled and all code had to go. the interpreter
+   counts its own pages in decode_cache_invalidate, run_jit never reuses
+   what it decodes */
+inline int jit_invalidate(Vm& vm, uint16_t address)
+{
+    jit_state& j = *vm.jit;
+    if (j.code_page[address >> 8] & JIT_CODE) { ++vm.code_generation[address >> 8]; }
+    if (!j.code_word[address]) { return 0; }
+    jit_flush(j);
+    return 1;
+}
+
+/* called by compiled code for a store to a page with compiled code or
+   devices, the block has to stop if the word itself was compiled or the
+   store reached MCR and stopped the machine */
+inline int jit_store(Vm& vm, uint16_t address, uint16_t val)
+{
+    if (address >= DEVICE_BASE) { device_write(vm, address, val); }
+    return jit_invalidate(vm, address) | !vm.running;
+}
+
+struct jit_emitter
+{
+    uint8_t* p;
+
+    void b(uint8_t x) { *p++ = x; }
+    void w(uint16_t x) { memcpy(p, &x, 2); p += 2; }
+    void d(uint32_t x) { memcpy(p, &x, 4); p += 4; }
+    void q(uint64_t x) { memcpy(p, &x, 8); p += 8; }
+    void bytes(std::initializer_list<uint8_t> xs) { for (uint8_t x : xs) b(x); }
+
+    /* rbx = cpu, r12 = memory, r13 = code_page, r14 = vm. eax, ecx, edx are scratch. */
+    void load_reg(unsigned r) { bytes({0x0F, 0xB7, 0x43, (uint8_t)(2 * r)}); }         /* movzx eax, [rbx+2r] */
+    void store_reg(unsigned r) { bytes({0x66, 0x89, 0x43, (uint8_t)(2 * r)}); }        /* mov [rbx+2r], ax */
+    void set_reg(unsigned r, uint16_t v) { bytes({0x66, 0xC7, 0x43, (uint8_t)(2 * r)}); w(v); }
+    void address_from_eax() { bytes({0x0F, 0xB7, 0xC8}); }                              /* movzx ecx, ax */
+
+    void call(const void* fn)
+    {
+        b(0x48); b(0xB8); q((uint64_t)fn);  /* mov rax, fn */
+        b(0xFF); b(0xD0);                   /* call rax */
+    }
+
+    /* charges the block to cpu.cycles, or leaves if it would pass cpu.limit */
+    void enter(uint16_t start, unsigned n)
+    {
+        const uint8_t cycles = offsetof(cpu_state, cycles), limit = offsetof(cpu_state, limit);
+        bytes({0x48, 0x8B, 0x43, cycles});          /* mov rax, [rbx+cycles] */
+        bytes({0x48, 0x83, 0xC0, (uint8_t)n});      /* add rax, n */
+        bytes({0x48, 0x3B, 0x43, limit});           /* cmp rax, [rbx+limit] */
+        b(0x76); b(12);                             /* jbe go */
+        set_reg(R_PC, start);
+        b(0xB8); d(JIT_OVER_BUDGET);                /* mov eax, JIT_OVER_BUDGET */
+        b(0xC3);                                    /* ret */
+        bytes({0x48, 0x89, 0x43, cycles});          /* go: mov [rbx+cycles], rax */
+    }
+
+    /* eax = mem_read(address) */
+    void read_static(uint16_t address)
+    {
+        if (address < DEVICE_BASE)
+        {
+            bytes({0x41, 0x0F, 0xB7, 0x84, 0x24}); d(2 * address); /* movzx eax, [r12+2a] */
+        }
+        else
+        {
+            bytes({0x4C, 0x89, 0xF7});              /* mov rdi, r14 */
+            b(0xBE); d(address);                    /* mov esi, a */
+            call((const void*)device_read);
+            bytes({0x0F, 0xB7, 0xC0});              /* movzx eax, ax */
+        }
+    }
+
+    /* eax = mem_read(ecx), only device space takes the slow path */
+    void read_dynamic()
+    {
+        b(0x81); b(0xF9); d(DEVICE_BASE);           /* cmp ecx, DEVICE_BASE */
+        b(0x72); b(22);                             /* jb fast */
+        bytes({0x4C, 0x89, 0xF7});                  /* mov rdi, r14 */
+        b(0x89); b(0xCE);                           /* mov esi, ecx */
+        call((const void*)device_read);
+        bytes({0x0F, 0xB7, 0xC0});                  /* movzx eax, ax */
+        b(0xEB); b(5);                              /* jmp done */
+        bytes({0x41, 0x0F, 0xB7, 0x04, 0x4C});      /* fast: movzx eax, [r12+2*rcx] */
+    }
+
+    /* memory[ecx] = ax, leaving the block if it was compiled code. the
+       instructions after this one were charged but will not run */
+    void write(uint16_t next_pc, unsigned unexecuted)
+    {
+        bytes({0x66, 0x41, 0x89, 0x04, 0x4C});      /* mov [r12+2*rcx], ax */
+        b(0x89); b(0xCA);                           /* mov edx, ecx */
+        b(0xC1); b(0xEA); b(8);                     /* shr edx, 8 */
+        bytes({0x49, 0x0F, 0xAB, 0x96}); d(offsetof(Vm, dirty)); /* bts [r14+dirty], rdx */
+        bytes({0x41, 0xF6, 0x44, 0x15, 0x00, 0x03});/* test byte [r13+rdx], JIT_CODE | JIT_DEVICE */
+        b(0x74); b(37);                             /* jz done */
+        bytes({0x4C, 0x89, 0xF7});                  /* mov rdi, r14 */
+        b(0x89); b(0xCE);                           /* mov esi, ecx */
+        b(0x89); b(0xC2);                           /* mov edx, eax */
+        call((const void*)jit_store);
+        b(0x85); b(0xC0);                           /* test eax, eax */
+        b(0x74); b(14);                             /* jz done */
+        set_reg(R_PC, next_pc);
+        bytes({0x48, 0x83, 0x6B, (uint8_t)offsetof(cpu_state, cycles), (uint8_t)unexecuted}); /* sub [rbx+cycles], n */
+        b(0x31); b(0xC0);                           /* xor eax, eax */
+        b(0xC3);                                    /* ret */
+    }
+
+    /* cpu.flag_result = ax */
+    void flags()
+    {
+        bytes({0x66, 0x89, 0x43, (uint8_t)offsetof(cpu_state, flag_result)});
+    }
+
+    /* ecx = cond_flags() */
+    void cond()
+    {
+        bytes({0x0F, 0xB7, 0x43, (uint8_t)offsetof(cpu_state, flag_result)}); /* movzx eax, [rbx+flag_result] */
+        b(0xB9); d(FL_POS);                         /* mov ecx, FL_POS */
+        b(0xBA); d(FL_ZRO);                         /* mov edx, FL_ZRO */
+        bytes({0x66, 0x85, 0xC0});                  /* test ax, ax */
+        bytes({0x0F, 0x44, 0xCA});                  /* cmovz ecx, edx */
+        b(0xBA); d(FL_NEG);                         /* mov edx, FL_NEG */
+        bytes({0x0F, 0x48, 0xCA});                  /* cmovs ecx, edx */
+    }
+
+    /* leave for a known PC, returning the jmp so the dispatcher can link it */
+    void exit_to(uint16_t pc)
+    {
+        set_reg(R_PC, pc);
+        b(0xE9); d(0);                              /* link: jmp +0 */
+        bytes({0x48, 0x8D, 0x05}); d(-12);          /* lea rax, [link] */
+        b(0xC3);                                    /* ret */
+    }
+
+    /* leave with R_PC already set */
+    void exit_indirect()
+    {
+        b(0x31); b(0xC0);                           /* xor eax, eax */
+        b(0xC3);                                    /* ret */
+    }
+};
+
+inline int Vm::enable_jit()
+{
+    if (jit) { return 1; }
+    void* buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) { return 0; }
+    jit = new jit_state;
+    jit->buffer = (uint8_t*)buffer;
+    jit->epoch = 0;
+    engine = NULL;
+
+    jit_emitter e = { jit->buffer };
+    e.bytes({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56}); /* push rbx, r12, r13, r14 */
+    e.bytes({0x49, 0x89, 0xF6});                         /* mov r14, rsi */
+    e.bytes({0x48, 0x89, 0xD3});                         /* mov rbx, rdx */
+    e.bytes({0x49, 0x89, 0xCC});                         /* mov r12, rcx */
+    e.bytes({0x4D, 0x89, 0xC5});                         /* mov r13, r8 */
+    e.bytes({0xFF, 0xD7});                               /* call rdi */
+    e.bytes({0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B}); /* pop r14, r13, r12, rbx */
+    e.b(0xC3);
+    jit->start = e.p;
+    jit_flush(*jit);
+    return 1;
+}
+
+inline void jit_free(jit_state* j)
+{
+    if (!j) { return; }
+    munmap(j->buffer, JIT_BUFFER_SIZE);
+    delete j;
+}
+
+/* returns NULL when the block has to start in the interpreter */
+inline uint8_t* jit_compile(Vm& vm, uint16_t start)
+{
+    jit_state& j = *vm.jit;
+    if (j.buffer + JIT_BUFFER_SIZE - j.end < JIT_MAX_CODE) { jit_flush(j); }
+
+    /* decode the block, it ends at BR, JMP, JSR, or before a TRAP, an RTI
+       or a JMPT, which change the PSR */
+    decoded block[JIT_MAX_BLOCK];
+    uint16_t address[JIT_MAX_BLOCK];
+    int n = 0;
+    int terminated = 0;
+    uint16_t pc = start;
+    while (n < JIT_MAX_BLOCK && pc < DEVICE_BASE)
+    {
+        uint16_t instr = vm.memory[pc];
+        uint16_t op = instr >> 12;
+        if (op == OP_TRAP || op == OP_RTI || op == OP_RES || (op == OP_JMP && (instr & 1))) { break; }
+        decode_table[op](pc + 1, instr, block[n]);
+        block[n].op = op;
+        address[n++] = pc++;
+        if (op == OP_JMP || op == OP_JSR || (op == OP_BR && block[n - 1].cond))
+        {
+            terminated = 1;
+            break;
+        }
+    }
+    if (n == 0) { return NULL; }
+
+    /* only the last flag write before each exit is visible */
+    uint8_t materialize[JIT_MAX_BLOCK];
+    int needed = 1;
+    for (int i = n - 1; i >= 0; --i)
+    {
+        uint16_t opbit = 1 << block[i].op;
+        materialize[i] = 0;
+        if (0x0888 & opbit) { needed = 1; }
+        if (0x4666 & opbit)
+        {
+            materialize[i] = needed;
+            needed = 0;
+        }
+    }
+
+    jit_emitter e = { j.end };
+    uint8_t* code = j.end;
+    e.enter(start, n);
+    for (int i = 0; i < n; ++i)
+    {
+        const decoded& d = block[i];
+        uint16_t next = address[i] + 1;
+        switch (d.op)
+        {
+            case OP_ADD:
+            case OP_AND:
+                e.load_reg(d.r1);
+                if (d.imm_flag)
+                {
+                    e.b(d.op == OP_ADD ? 0x05 : 0x25); e.d(d.imm5);       /* add/and eax, imm */
+                }
+                else
+                {
+                    e.bytes({0x66, (uint8_t)(d.op == OP_ADD ? 0x03 : 0x23), 0x43, (uint8_t)(2 * d.r2)});
+                }
+                e.store_reg(d.r0);
+                break;
+            case OP_NOT:
+                e.load_reg(d.r1);
+                e.b(0xF7); e.b(0xD0);                                     /* not eax */
+                e.store_reg(d.r0);
+                break;
+            case OP_LEA:
+                e.b(0xB8); e.d(d.pc_plus_off);                            /* mov eax, imm */
+                e.store_reg(d.r0);
+                break;
+            case OP_LD:
+                e.read_static(d.pc_plus_off);
+                e.store_reg(d.r0);
+                break;
+            case OP_LDI:
+                e.read_static(d.pc_plus_off);
+                e.address_from_eax();
+                e.read_dynamic();
+                e.store_reg(d.r0);
+                break;
+            case OP_LDR:
+                e.load_reg(d.r1);
+                e.b(0x05); e.d(d.base_off);                               /* add eax, off */
+                e.address_from_eax();
+                e.read_dynamic();
+                e.store_reg(d.r0);
+                break;
+            case OP_ST:
+                e.load_reg(d.r0);
+                e.b(0xB9); e.d(d.pc_plus_off);                            /* mov ecx, a */
+                e.write(next, n - i - 1);
+                break;
+            case OP_STI:
+                e.read_static(d.pc_plus_off);
+                e.address_from_eax();
+                e.load_reg(d.r0);
+                e.write(next, n - i - 1);
+                break;
+            case OP_STR:
+                e.load_reg(d.r1);
+                e.b(0x05); e.d(d.base_off);                               /* add eax, off */
+                e.address_from_eax();
+                e.load_reg(d.r0);
+                e.write(next, n - i - 1);
+                break;
+            case OP_BR:
+                if (d.cond == 0x7)
+                {
+                    e.exit_to(d.pc_plus_off);
+                }
+                else if (d.cond)
+                {
+                    e.cond();
+                    e.bytes({0xF6, 0xC1, d.cond});                        /* test cl, cond */
+                    e.b(0x74); e.b(19);                                   /* jz not taken */
+                    e.exit_to(d.pc_plus_off);
+                    e.exit_to(next);
+                }
+                break;
+            case OP_JMP:
+                e.load_reg(d.r1);
+                e.store_reg(R_PC);
+                e.exit_indirect();
+                break;
+            case OP_JSR:
+                e.set_reg(R_R7, next);
+                if (d.long_flag)
+                {
+                    e.exit_to(d.pc_plus_off);
+                }
+                else
+                {
+                    e.load_reg(d.r1);
+                    e.store_reg(R_PC);
+                    e.exit_indirect();
+                }
+                break;
+        }
+        if (materialize[i]) { e.flags(); }
+    }
+    if (!terminated) { e.exit_to(pc); }
+
+    j.end = e.p;
+    for (int i = 0; i < n; ++i)
+    {
+        j.code_page[address[i] >> 8] |= JIT_CODE;
+        j.code_word[address[i]] = 1;
+    }
+    j.block[start] = code;
+    if (vm.metrics) { vm.metrics->jit_blocks.add(1); }
+    return code;
+}
+
+/* compiles a block ahead of its first run */
+inline void jit_prepare(Vm& vm, uint16_t start)
+{
+    if (!vm.jit->block[start]) { jit_compile(vm, start); }
+}
+
+inline void run_jit(Vm& vm, uint64_t limit)
+{
+    jit_state& j = *vm.jit;
+    jit_enter_fn enter = (jit_enter_fn)j.buffer;
+    uint16_t* reg = vm.cpu.reg;
+    uint8_t* link = NULL;
+    unsigned link_epoch = 0;
+    vm.cpu.limit = limit;
+    while (vm.running && vm.cpu.cycles < limit)
+    {
+        uint16_t pc = reg[R_PC];
+        uint8_t* code = j.block[pc];
+        if (!code) { code = jit_compile(vm, pc); }
+        if (code)
+        {
+            /* chain the block we just left straight to this one */
+            if (link && link_epoch == j.epoch)
+            {
+                int32_t rel = (int32_t)(code - (link + 5));
+                memcpy(link + 1, &rel, 4);
+            }
+            link_epoch = j.epoch;
+            link = enter(code, &vm, &vm.cpu, vm.memory, j.code_page);
+            if ((uintptr_t)link != JIT_OVER_BUDGET) { continue; }
+            /* possibly in a block chained further on */
+            if (vm.cpu.cycles >= limit) { break; }
+            pc = reg[R_PC];
+        }
+
+        /* TRAPs, code in device space, and the last few instructions
+           before the limit are interpreted */
+        decoded tmp;
+        reg[R_PC]++;
+        decoded& e = decode_address(vm, pc, tmp);
+        op_table[e.instr >> 12](vm, e);
+        ++vm.cpu.cycles;
+        if (vm.metrics) { vm.metrics->jit_interpreted.add(1); }
+        link = NULL;
+    }
+}
+#else
+struct jit_state {};
+inline void jit_flush(jit_state& j) {}
+inline int jit_invalidate(Vm& vm, uint16_t address) { return 0; }
+inline void jit_free(jit_state* j) {}
+inline void jit_prepare(Vm& vm, uint16_t start) {}
+inline int Vm::enable_jit() { return 0; }
+inline void run_jit(Vm& vm, uint64_t limit) {}
+#endif
+
+/* Code Map */
+/* an image is just words, nothing says which of them are instructions and
+   which are strings for PUTS or tables behind an LDI. the map follows the
+   code that can be reached from the PC, PC_START and, under the OS, the
+   trap and interrupt vectors, and marks the words it loads and stores on
+   the way. it splits the code into basic blocks and every page below
+   device space into code, data or both. jumps through registers it cannot
+   follow, so a map can miss code but never calls data code, and whatever
+   it missed is still decoded when it first runs */
+enum
+{
+    WORD_CODE = 1,
+    WORD_DATA = 2,       /* named by a load, a store or an LEA */
+    WORD_LEADER = 4      /* a block starts here */
+};
+
+enum page_kind { PAGE_EMPTY, PAGE_CODE, PAGE_DATA, PAGE_MIXED, PAGE_DEVICE };
+
+struct code_block
+{
+    uint16_t start;
+    uint16_t end;        /* one past its last instruction */
+    uint16_t succ[2];    /* where it goes on, as far as that is known */
+    uint8_t succs;
+    bool indirect;       /* it also goes where a register says */
+};
+
+struct code_map
+{
+    uint8_t word[UINT16_MAX + 1] = {};
+    uint8_t page[256] = {};              /* a page_kind each */
+    std::vector<code_block> blocks;      /* in address order */
+    unsigned count[PAGE_DEVICE + 1] = {}; /* pages of each kind */
+};
+
+/* what the instruction at pc does to the flow: where else it goes, and
+   whether it goes on to the next word at all */
+inline bool code_flow(const Vm& vm, uint16_t pc, const decoded& d, uint16_t* target, unsigned& targets,
+                      bool& indirect)
+{
+    targets = 0;
+    indirect = false;
+    switch (d.instr >> 12)
+    {
+        case OP_BR:
+            if (!d.cond) { return true; }
+            target[targets++] = d.pc_plus_off;
+            return d.cond != (FL_NEG | FL_ZRO | FL_POS);
+        case OP_JMP:
+            indirect = true;
+            return false;
+        case OP_JSR:
+            if (d.long_flag) { target[targets++] = d.pc_plus_off; }
+            /* the pointer of an LD just before is known */
+            else if (pc > 0 && (vm.memory[pc - 1] >> 12) == OP_LD && ((vm.memory[pc - 1] >> 9) & 7) == d.r1)
+            {
+                target[targets++] = vm.memory[(uint16_t)(pc + sign_extend(vm.memory[pc - 1] & 0x1FF, 9))];
+            }
+            else { indirect = true; }
+            return true;
+        case OP_TRAP:
+            return (d.instr & 0xFF) != TRAP_HALT;
+        case OP_RTI:
+        case OP_RES:
+            return false;
+    }
+    return true;
+}
+
+/* a block ends at anything that leaves the straight line */
+inline bool code_ends_block(const decoded& d)
+{
+    switch (d.instr >> 12)
+    {
+        case OP_BR: return d.cond != 0;
+        case OP_JMP: case OP_JSR: case OP_TRAP: case OP_RTI: case OP_RES: return true;
+    }
+    return false;
+}
+
+inline void code_mark_data(code_map& m, uint32_t address)
+{
+    if (address < DEVICE_BASE) { m.word[address] |= WORD_DATA; }
+}
+
+inline void code_map_build(const Vm& vm, code_map& m)
+{
+    std::vector<uint16_t> work = { vm.cpu.reg[R_PC], (uint16_t)PC_START };
+    if (vm.os)
+    {
+        for (uint16_t v = 0; v < 2 * 0x100; ++v)
+        {
+            if (vm.memory[v]) { work.push_back(vm.memory[v]); }
+        }
+    }
+
+    while (!work.empty())
+    {
+        uint16_t pc = work.back();
+        work.pop_back();
+        if (pc >= DEVICE_BASE) { continue; }
+        m.word[pc] |= WORD_LEADER;
+        for (; pc < DEVICE_BASE && !(m.word[pc] & WORD_CODE); ++pc)
+        {
+            m.word[pc] |= WORD_CODE;
+            decoded d;
+            uint16_t instr = vm.memory[pc];
+            decode_table[instr >> 12](pc + 1, instr, d);
+            d.instr = instr;
+            switch (instr >> 12)
+            {
+                case OP_LD: case OP_ST: case OP_LEA:
+                    code_mark_data(m, d.pc_plus_off);
+                    break;
+                case OP_LDI: case OP_STI:
+                    code_mark_data(m, d.pc_plus_off);
+                    code_mark_data(m, vm.memory[d.pc_plus_off]);
+                    break;
+            }
+            uint16_t target[1];
+            unsigned targets;
+            bool indirect;
+            bool on = code_flow(vm, pc, d, target, targets, indirect);
+            for (unsigned i = 0; i < targets; ++i) { work.push_back(target[i]); }
+            if (!on) { break; }
+            if (code_ends_block(d)) { work.push_back(pc + 1); }
+        }
+    }
+
+    /* a block runs up to whatever ends it, the next leader, or the end of the code */
+    for (uint32_t pc = 0; pc < DEVICE_BASE;)
+    {
+        if (!(m.word[pc] & WORD_CODE))
+        {
+            ++pc;
+            continue;
+        }
+        m.word[pc] |= WORD_LEADER;
+        code_block b;
+        b.start = pc;
+        decoded d;
+        bool on = true;
+        b.succs = 0;
+        b.indirect = false;
+        for (;;)
+        {
+            uint16_t instr = vm.memory[pc];
+            decode_table[instr >> 12](pc + 1, instr, d);
+            d.instr = instr;
+            unsigned targets;
+            on = code_flow(vm, pc, d, b.succ, targets, b.indirect);
+            b.succs = targets;
+            ++pc;
+            if (code_ends_block(d) || pc >= DEVICE_BASE || (m.word[pc] & (WORD_CODE | WORD_LEADER)) != WORD_CODE)
+            {
+                break;
+            }
+        }
+        b.end = pc;
+        if (on && b.succs < 2) { b.succ[b.succs++] = b.end; }
+        m.blocks.push_back(b);
+    }
+
+    for (unsigned p = 0; p < 256; ++p)
+    {
+        bool code = false, data = false;
+        for (unsigned i = p << 8; p < DEVICE_BASE >> 8 && i < (p + 1) << 8; ++i)
+        {
+            code |= (m.word[i] & WORD_CODE) != 0;
+            /* a word nothing ran is data if anything is in it */
+            data |= (m.word[i] & WORD_DATA) || (!(m.word[i] & WORD_CODE) && vm.memory[i]);
+        }
+        m.page[p] = p >= DEVICE_BASE >> 8 ? PAGE_DEVICE
+                  : code && data ? PAGE_MIXED : code ? PAGE_CODE : data ? PAGE_DATA : PAGE_EMPTY;
+        ++m.count[m.page[p]];
+    }
+}
+
+/* decodes all the code up front, superinstructions included, and compiles
+   every block when the JIT is on, so none of it waits for its first run.
+   pages of data are never touched, no entry of theirs is resident and a
+   store to them stays a single test */
+inline void code_map_preload(Vm& vm, const code_map& m)
+{
+    decoded tmp;
+    for (const code_block& b : m.blocks)
+    {
+        for (uint32_t pc = b.start; pc < b.end; ++pc)
+        {
+            if (!vm.pages.resident[pc >> 8] && vm.pages.used >= vm.pages.limit) { break; }
+            if (vm.decode_cache[pc].op == OP_DECODE) { decode_address(vm, pc, tmp); }
+        }
+        if (vm.jit) { jit_prepare(vm, b.start); }
+    }
+}
+
+inline void code_map_report(const code_map& m, FILE* out)
+{
+    unsigned words = 0;
+    for (uint32_t i = 0; i < DEVICE_BASE; ++i) { words += m.word[i] & WORD_CODE; }
+    fprintf(out, "analysis: %zu blocks in %u words of code, %u code pages, %u data pages, %u mixed\n",
+            m.blocks.size(), words, m.count[PAGE_CODE], m.count[PAGE_DATA], m.count[PAGE_MIXED]);
+    for (unsigned p = 0; p < 256; ++p)
+    {
+        if (m.page[p] == PAGE_MIXED) { fprintf(out, "  mixed page x%02X00\n", p); }
+    }
+}
+
+/* Vm Run */
+inline void run_traced(Vm& vm, uint64_t limit);
+inline void trace_checkpoint(Vm& vm);
+
+inline Vm::Vm()
+{
+    void* m = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) { throw std::bad_alloc(); }
+    memory = (uint16_t*)m;
+    memset(&cpu, 0, sizeof(cpu));
+    io = &console();
+    engine = NULL;
+    fuzz = NULL;
+    metrics = NULL;
+    memset(dirty, 0, sizeof(dirty));
+    memset(code_generation, 0, sizeof(code_generation));
+    memset(devices, 0, sizeof(devices));
+    device_map(MR_KBSR >> 8, keyboard_read, keyboard_write);
+    decode_cache = decode_cache_map();
+    jit = NULL;
+    profile = NULL;
+    display = NULL;
+    trace = NULL;
+    debug = NULL;
+    idle = false;
+    os = false;
+    reset();
+}
+
+inline Vm::~Vm()
+{
+    disable_trace();
+    jit_free(jit);
+    delete profile;
+    delete display;
+    delete debug;
+    munmap(decode_cache, DECODE_CACHE_SIZE);
+    munmap(memory, MEMORY_SIZE);
+}
+
+/* the engines run in slices and the devices get a look between them,
+   often enough for an interrupt not to wait long once one is enabled */
+inline uint64_t Vm::run_until(uint64_t cycles)
+{
+    uint64_t begin = cpu.cycles;
+    auto start = metrics ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+    while (running && cycles > cpu.cycles)
+    {
+        uint64_t slice = RUN_SLICE;
+        if (interrupts_armed(*this))
+        {
+            interrupt_poll(*this);
+            slice = INTERRUPT_SLICE;
+        }
+        uint64_t until = cycles - cpu.cycles > slice ? cpu.cycles + slice : cycles;
+        if (profile)
+        {
+            cpu.cycles += run_profiled(*this, until - cpu.cycles);
+        }
+        else if (trace)
+        {
+            run_traced(*this, until);
+        }
+        else if (jit)
+        {
+            run_jit(*this, until);
+        }
+        else
+        {
+            cpu.cycles += (engine ? engine : run_interpreter<plain_policy>)(*this, until - cpu.cycles);
+        }
+        if (metrics) { start = metrics->slice(cpu.cycles, start); }
+    }
+    if (display) { display_tick(*this); }
+    return cpu.cycles - begin;
+}
+
+inline uint64_t Vm::step(uint64_t n)
+{
+    return run_until(n > UINT64_MAX - cpu.cycles ? UINT64_MAX : cpu.cycles + n);
+}
+
+/* Snapshot */
+/* a machine frozen at one point. memory sits in an anonymous file, and
+   every Vm started from the snapshot maps it MAP_PRIVATE, so it shares all
+   of it and copies a page only when it writes one. device registers live
+   in memory and are frozen with it */
+struct vm_snapshot
+{
+    int memory_fd = -1;
+    cpu_state cpu;
+    bool running;
+    bool os;
+    vm_io* io;
+    device_page devices[DEVICE_PAGES];
+    std::unique_ptr<display_state> display;
+    interrupt_state irq;
+
+    vm_snapshot() {}
+    vm_snapshot(const vm_snapshot&) = delete;
+    vm_snapshot& operator=(const vm_snapshot&) = delete;
+    ~vm_snapshot()
+    {
+        if (memory_fd >= 0) { close(memory_fd); }
+    }
+};
+
+inline std::shared_ptr<vm_snapshot> Vm::snapshot() const
+{
+    std::shared_ptr<vm_snapshot> s(new vm_snapshot);
+    s->memory_fd = anonymous_file(memory, MEMORY_SIZE);
+    if (s->memory_fd < 0) { return NULL; }
+    s->cpu = cpu;
+    s->running = running;
+    s->os = os;
+    s->io = io;
+    memcpy(s->devices, devices, sizeof(devices));
+    if (display) { s->display.reset(new display_state(*display)); }
+    s->irq = irq;
+    return s;
+}
+
+/* the decode cache starts cold, so a child only copies the pages it runs */
+inline int Vm::restore(const vm_snapshot& s)
+{
+    if (!map_private(memory, MEMORY_SIZE, s.memory_fd)) { return 0; }
+    cpu = s.cpu;
+    running = s.running;
+    os = s.os;
+    io = s.io;
+    memcpy(devices, s.devices, sizeof(devices));
+    irq = s.irq;
+    /* the screen comes back with its device handlers */
+    if (s.display)
+    {
+        if (!display) { display = new display_state; }
+        *display = *s.display;
+    }
+    else
+    {
+        delete display;
+        display = NULL;
+    }
+    decode_cache_reset(*this);
+    if (jit) { jit_flush(*jit); }
+    /* a trace goes on from the state it was given */
+    if (trace) { trace_checkpoint(*this); }
+    return 1;
+}
+
+inline Vm::Vm(const vm_snapshot& s)
+{
+    memory = (uint16_t*)mmap(NULL, MEMORY_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) { throw std::bad_alloc(); }
+    decode_cache = decode_cache_map();
+    jit = NULL;
+    profile = NULL;
+    display = NULL;
+    trace = NULL;
+    debug = NULL;
+    engine = NULL;
+    fuzz = NULL;
+    metrics = NULL;
+    memset(dirty, 0, sizeof(dirty));
+    memset(code_generation, 0, sizeof(code_generation));
+    idle = false;
+    if (!restore(s))
+    {
+        munmap(memory, MEMORY_SIZE);
+        munmap(decode_cache, DECODE_CACHE_SIZE);
+        throw std::bad_alloc();
+    }
+}
+
+/* children start exactly where this machine is now, and cost nothing
+   until they write. take one snapshot and construct from it to start
+   many of them */
+inline std::unique_ptr<Vm> Vm::fork() const
+{
+    std::shared_ptr<vm_snapshot> s = snapshot();
+    if (!s) { return NULL; }
+    return std::unique_ptr<Vm>(new Vm(*s));
+}
+
+/* the file keeps the registers and the pages that are not all zero,
+   host handlers and the decode cache are rebuilt on load. version 0 files
+   end the header at psr and come back in supervisor mode */
+struct snapshot_header
+{
+    char magic[8];
+    uint16_t reg[R_COUNT];
+    uint16_t flag_result;
+    uint16_t running;
+    uint32_t pages; /* bit n set when memory page n follows */
+    uint16_t os;
+    uint16_t version;
+    uint64_t cycles;
+    uint16_t psr;
+    uint16_t saved_ssp;
+    uint16_t saved_usp;
+    uint16_t interrupts; /* KBSR's enable bit, and TR's one bit lower */
+    uint16_t interval;
+};
+
+enum
+{
+    SNAPSHOT_PAGES = MEMORY_SIZE / IMAGE_PAGE,
+    SNAPSHOT_VERSION = 1
+};
+
+/* the bytes of a snapshot file, appended to out */
+inline void snapshot_write(const Vm& vm, std::string& out)
+{
+    const cpu_state& cpu = vm.cpu;
+    const interrupt_state& irq = vm.irq;
+    snapshot_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    memcpy(h.reg, cpu.reg, sizeof(h.reg));
+    h.flag_result = cpu.flag_result;
+    h.running = vm.running;
+    h.os = vm.os;
+    h.version = SNAPSHOT_VERSION;
+    h.cycles = cpu.cycles;
+    h.psr = cpu.psr;
+    h.saved_ssp = cpu.saved_ssp;
+    h.saved_usp = cpu.saved_usp;
+    h.interrupts = (irq.keyboard ? INTERRUPT_ENABLE : 0) | (irq.timer ? INTERRUPT_ENABLE >> 1 : 0);
+    h.interval = irq.interval;
+
+    static const uint8_t zero[IMAGE_PAGE] = {};
+    const uint8_t* mem = (const uint8_t*)vm.memory;
+    for (int p = 0; p < SNAPSHOT_PAGES; ++p)
+    {
+        if (memcmp(mem + p * IMAGE_PAGE, zero, IMAGE_PAGE) != 0) { h.pages |= 1u << p; }
+    }
+
+    out.append((const char*)&h, sizeof(h));
+    for (int p = 0; p < SNAPSHOT_PAGES; ++p)
+    {
+        if (h.pages & (1u << p)) { out.append((const char*)mem + p * IMAGE_PAGE, IMAGE_PAGE); }
+    }
+}
+
+inline int Vm::save_snapshot(const char* path) const
+{
+    std::string data;
+    snapshot_write(*this, data);
+    FILE* out = fopen(path, "wb");
+    if (!out) { return 0; }
+    fwrite(data.data(), 1, data.size(), out);
+    return fclose(out) == 0;
+}
+
+inline int load_snapshot(Vm& vm, const uint8_t* file, size_t size)
+{
+    snapshot_header h;
+    memset(&h, 0, sizeof(h));
+    size_t header = offsetof(snapshot_header, psr);
+    if (size < header) { return 0; }
+    memcpy(&h, file, header);
+    if (h.version > 0)
+    {
+        header = sizeof(h);
+        if (size < header) { return 0; }
+        memcpy(&h, file, header);
+    }
+    size_t pages = 0;
+    for (int p = 0; p < SNAPSHOT_PAGES; ++p) { pages += (h.pages >> p) & 1; }
+    if (size < header + pages * IMAGE_PAGE) { return 0; }
+
+    const uint8_t* data = file + header;
+    uint8_t* mem = (uint8_t*)vm.memory;
+    for (int p = 0; p < SNAPSHOT_PAGES; ++p)
+    {
+        if (h.pages & (1u << p))
+        {
+            memcpy(mem + p * IMAGE_PAGE, data, IMAGE_PAGE);
+            data += IMAGE_PAGE;
+        }
+        else
+        {
+            memset(mem + p * IMAGE_PAGE, 0, IMAGE_PAGE);
+        }
+    }
+    memcpy(vm.cpu.reg, h.reg, sizeof(h.reg));
+    vm.cpu.flag_result = h.flag_result;
+    vm.cpu.cycles = h.cycles;
+    vm.running = h.running != 0;
+    vm.os = h.os != 0;
+    vm.cpu.psr = h.psr;
+    vm.cpu.saved_ssp = h.version > 0 ? h.saved_ssp : SUPERVISOR_STACK;
+    vm.cpu.saved_usp = h.saved_usp;
+    vm.irq = interrupt_state();
+    vm.irq.keyboard = h.interrupts & INTERRUPT_ENABLE;
+    vm.irq.timer = h.interrupts & (INTERRUPT_ENABLE >> 1);
+    if (h.interval) { timer_start(vm, h.interval); }
+    if (vm.os) { os_devices(vm); }
+    return 1;
+}
+
+/* Trace Packing */
+/* byte oriented LZ77 in the style of LZ4, small enough to run on the
+   trace writer without a library. a sequence is a token, its literals and
+   a match: the token's high nibble counts literals and the low one the
+   match length past LZ_MIN_MATCH, 15 meaning more follows in bytes of up
+   to 255. the match is a 16 bit back offset. the last sequence has no match */
+enum
+{
+    LZ_HASH_BITS = 12,
+    LZ_MIN_MATCH = 4,
+    LZ_WINDOW = 0xFFFF
+};
+
+inline uint32_t lz_hash(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+inline void lz_length(std::string& out, size_t n)
+{
+    for (; n >= 255; n -= 255) { out += (char)255; }
+    out += (char)n;
+}
+
+inline void lz_sequence(std::string& out, const uint8_t* lit, size_t n, size_t offset, size_t len)
+{
+    size_t m = len ? len - LZ_MIN_MATCH : 0;
+    out += (char)((n < 15 ? n : 15) << 4 | (m < 15 ? m : 15));
+    if (n >= 15) { lz_length(out, n - 15); }
+    out.append((const char*)lit, n);
+    if (!len) { return; }
+    out += (char)(offset & 0xFF);
+    out += (char)(offset >> 8);
+    if (m >= 15) { lz_length(out, m - 15); }
+}
+
+inline void lz_pack(const uint8_t* in, size_t n, std::string& out)
+{
+    std::vector<uint32_t> table(1 << LZ_HASH_BITS); /* a position + 1 per hash */
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + LZ_MIN_MATCH <= n)
+    {
+        uint32_t h = lz_hash(in + i);
+        size_t from = table[h];
+        table[h] = i + 1;
+        if (from == 0 || i - (from - 1) > LZ_WINDOW || memcmp(in + from - 1, in + i, LZ_MIN_MATCH) != 0)
+        {
+            ++i;
+            continue;
+        }
+        --from;
+        size_t len = LZ_MIN_MATCH;
+        while (i + len < n && in[from + len] == in[i + len]) { ++len; }
+        lz_sequence(out, in + anchor, i - anchor, i - from, len);
+        i += len;
+        anchor = i;
+    }
+    lz_sequence(out, in + anchor, n - anchor, 0, 0);
+}
+
+/* reads a length past 15 */
+inline bool lz_more(const uint8_t* in, size_t n, size_t& i, size_t& len)
+{
+    uint8_t b;
+    do
+    {
+        if (i == n) { return false; }
+        b = in[i++];
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+/* false unless in unpacks to exactly raw bytes */
+inline bool lz_unpack(const uint8_t* in, size_t n, size_t raw, std::string& out)
+{
+    out.clear();
+    out.reserve(raw);
+    size_t i = 0;
+    while (i < n)
+    {
+        uint8_t token = in[i++];
+        size_t lit = token >> 4;
+        if (lit == 15 && !lz_more(in, n, i, lit)) { return false; }
+        if (lit > n - i || out.size() + lit > raw) { return false; }
+        out.append((const char*)in + i, lit);
+        i += lit;
+        if (i == n) { break; }
+
+        if (n - i < 2) { return false; }
+        size_t offset = in[i] | in[i + 1] << 8;
+        i += 2;
+        size_t len = token & 15;
+        if (len == 15 && !lz_more(in, n, i, len)) { return false; }
+        len += LZ_MIN_MATCH;
+        if (!offset || offset > out.size() || out.size() + len > raw) { return false; }
+        /* the match may run into what it copies */
+        size_t from = out.size() - offset;
+        for (size_t k = 0; k < len; ++k) { out += out[from + k]; }
+    }
+    return out.size() == raw;
+}
+
+/* Trace */
+/* every instruction a machine retires, kept to look at a run after the
+   fact. a record holds what its instruction changed: the slots that differ
+   from before it, with the PC only when it did not just move on by one,
+   and the word it stored. the thread driving the Vm fills chunks of
+   records, and a writer thread of the trace's own packs them and appends
+   them to the file, the two handing chunks over through a ring of
+   TRACE_RING. every interval instructions the whole machine goes in as a
+   checkpoint, so the stretches between checkpoints replay on their own */
+enum
+{
+    TRACE_SLOTS = 13,      /* R0-R7, PC, flag_result, psr, saved_ssp, saved_usp */
+    TRACE_PC = 8,
+    TRACE_CHUNK = 1 << 16, /* bytes of records per frame */
+    TRACE_RING = 8,
+    TRACE_WRITES = 4,      /* the most words one record stores */
+    TRACE_KEEP = 1 << 26,  /* bytes of frames a trace in memory holds on to */
+    TRACE_MAX_RECORD = 3 + 2 * (TRACE_SLOTS + 1) + 1 + 4 * TRACE_WRITES,
+
+    /* a record starts with these flags */
+    TRACE_REGS = 1,        /* a mask of changed slots and their values follow */
+    TRACE_WRITE = 2,       /* a count of address, value pairs follows */
+    TRACE_EVENT = 4,       /* an interrupt taken, its vector follows instead of the instruction */
+    TRACE_HALT = 8         /* the machine stopped */
+};
+
+enum trace_kind
+{
+    TRACE_CHECKPOINT,      /* a snapshot file */
+    TRACE_RECORDS
+};
+
+const char TRACE_MAGIC[8] = { '\x89', 'L', 'C', '3', 'T', 'R', 'C', '\n' };
+
+/* in front of every chunk in the file, which is TRACE_MAGIC and frames */
+struct trace_frame
+{
+    uint32_t kind;
+    uint32_t raw;      /* bytes once unpacked */
+    uint32_t packed;   /* bytes that follow */
+    uint32_t records;
+    uint64_t first;    /* cpu.cycles at its start */
+    uint16_t pc;       /* where its first instruction is */
+    uint16_t reserved[3];
+};
+
+struct trace_chunk
+{
+    trace_frame frame;
+    std::string data;
+};
+
+struct trace_state
+{
+    FILE* out = NULL;              /* NULL keeps the frames in memory */
+    uint64_t interval = TRACE_INTERVAL;
+    uint64_t next_checkpoint = 0;
+    trace_chunk open;              /* filled by the thread running the Vm */
+
+    trace_chunk ring[TRACE_RING];
+    uint64_t head = 0;             /* chunks handed to the writer */
+    uint64_t tail = 0;             /* and taken by it */
+    bool closing = false;
+    std::mutex lock;
+    std::condition_variable ready; /* the writer waits for a chunk */
+    std::condition_variable space; /* the Vm waits for a free slot */
+    std::thread writer;
+
+    std::vector<trace_chunk> kept; /* the frames, unpacked, without a file */
+    size_t kept_bytes = 0;
+
+    uint64_t records = 0;
+    uint64_t checkpoints = 0;
+    bool failed = false;           /* set by the writer, read once it is done */
+};
+
+inline void trace_writer(trace_state* t)
+{
+    trace_chunk c;
+    std::string packed;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> guard(t->lock);
+            t->ready.wait(guard, [&] { return t->head != t->tail || t->closing; });
+            if (t->head == t->tail) { break; }
+            std::swap(c, t->ring[t->tail % TRACE_RING]);
+            ++t->tail;
+        }
+        t->space.notify_one();
+
+        packed.clear();
+        lz_pack((const uint8_t*)c.data.data(), c.data.size(), packed);
+        c.frame.raw = c.data.size();
+        c.frame.packed = packed.size();
+        if (fwrite(&c.frame, sizeof(c.frame), 1, t->out) != 1
+            || fwrite(packed.data(), 1, packed.size(), t->out) != packed.size())
+        {
+            t->failed = true;
+        }
+    }
+}
+
+inline void trace_begin(trace_state& t, trace_kind kind, const Vm& vm)
+{
+    memset(&t.open.frame, 0, sizeof(t.open.frame));
+    t.open.frame.kind = kind;
+    t.open.frame.first = vm.cpu.cycles;
+    t.open.frame.pc = vm.cpu.reg[R_PC];
+    t.open.data.clear();
+}
+
+/* without a file the open chunk joins the others in memory. past
+   TRACE_KEEP bytes the oldest checkpoint goes, with the records after it */
+inline void trace_keep(trace_state& t)
+{
+    t.kept_bytes += t.open.data.size();
+    t.kept.push_back(trace_chunk());
+    std::swap(t.open, t.kept.back());
+    while (t.kept_bytes > TRACE_KEEP)
+    {
+        size_t next = 1;
+        while (next < t.kept.size() && t.kept[next].frame.kind != TRACE_CHECKPOINT) { ++next; }
+        if (next == t.kept.size()) { break; }
+        for (size_t i = 0; i < next; ++i) { t.kept_bytes -= t.kept[i].data.size(); }
+        t.kept.erase(t.kept.begin(), t.kept.begin() + next);
+    }
+}
+
+/* hands the open chunk over, waiting while the writer is TRACE_RING behind.
+   the slot gives back a buffer the writer is done with */
+inline void trace_submit(trace_state& t)
+{
+    if (!t.out)
+    {
+        trace_keep(t);
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> guard(t.lock);
+        t.space.wait(guard, [&] { return t.head - t.tail < TRACE_RING; });
+        std::swap(t.open, t.ring[t.head % TRACE_RING]);
+        ++t.head;
+    }
+    t.ready.notify_one();
+}
+
+inline void trace_checkpoint(Vm& vm)
+{
+    trace_state& t = *vm.trace;
+    if (t.open.frame.records) { trace_submit(t); }
+    trace_begin(t, TRACE_CHECKPOINT, vm);
+    snapshot_write(vm, t.open.data);
+    trace_submit(t);
+    trace_begin(t, TRACE_RECORDS, vm);
+    ++t.checkpoints;
+    t.next_checkpoint = vm.cpu.cycles + t.interval;
+}
+
+/* a record never spans two chunks */
+inline void trace_reserve(Vm& vm)
+{
+    trace_state& t = *vm.trace;
+    if (t.open.data.size() + TRACE_MAX_RECORD <= TRACE_CHUNK) { return; }
+    trace_submit(t);
+    trace_begin(t, TRACE_RECORDS, vm);
+}
+
+inline void trace_slots(const Vm& vm, uint16_t* s)
+{
+    memcpy(s, vm.cpu.reg, TRACE_PC * sizeof(uint16_t));
+    s[TRACE_PC] = vm.cpu.reg[R_PC];
+    s[9] = vm.cpu.flag_result;
+    s[10] = vm.cpu.psr;
+    s[11] = vm.cpu.saved_ssp;
+    s[12] = vm.cpu.saved_usp;
+}
+
+inline void trace_set_slot(Vm& vm, int slot, uint16_t val)
+{
+    switch (slot)
+    {
+        case TRACE_PC: vm.cpu.reg[R_PC] = val; break;
+        case 9: vm.cpu.flag_result = val; break;
+        case 10: vm.cpu.psr = val; break;
+        case 11: vm.cpu.saved_ssp = val; break;
+        case 12: vm.cpu.saved_usp = val; break;
+        default: vm.cpu.reg[slot] = val; break;
+    }
+}
+
+inline void trace_put16(std::string& s, uint16_t v)
+{
+    s += (char)(v & 0xFF);
+    s += (char)(v >> 8);
+}
+
+/* word is the instruction, or the vector of an event. write holds
+   address, value pairs */
+inline void trace_record(Vm& vm, uint8_t flags, uint16_t word, const uint16_t* before,
+                         const uint16_t* write, unsigned writes)
+{
+    trace_state& t = *vm.trace;
+    uint16_t after[TRACE_SLOTS];
+    trace_slots(vm, after);
+    uint16_t next_pc = flags & TRACE_EVENT ? before[TRACE_PC] : before[TRACE_PC] + 1;
+    uint16_t mask = after[TRACE_PC] != next_pc ? 1 << TRACE_PC : 0;
+    for (int i = 0; i < TRACE_SLOTS; ++i)
+    {
+        if (i != TRACE_PC && after[i] != before[i]) { mask |= 1 << i; }
+    }
+    if (mask) { flags |= TRACE_REGS; }
+    if (writes) { flags |= TRACE_WRITE; }
+    if (!vm.running) { flags |= TRACE_HALT; }
+
+    std::string& s = t.open.data;
+    s += (char)flags;
+    if (flags & TRACE_EVENT) { s += (char)word; }
+    else { trace_put16(s, word); }
+    if (mask)
+    {
+        trace_put16(s, mask);
+        for (int i = 0; i < TRACE_SLOTS; ++i)
+        {
+            if (mask >> i & 1) { trace_put16(s, after[i]); }
+        }
+    }
+    if (writes)
+    {
+        s += (char)writes;
+        for (unsigned i = 0; i < 2 * writes; ++i) { trace_put16(s, write[i]); }
+    }
+    ++t.open.frame.records;
+    ++t.records;
+}
+
+/* one instruction, never a fused run of them, so each gets its record */
+inline const decoded& trace_fetch(Vm& vm, decoded& tmp)
+{
+    const decoded* d = &vm.decode_cache[vm.cpu.reg[R_PC]++];
+    if (d->op == OP_DECODE) { d = &decode_address(vm, vm.cpu.reg[R_PC] - 1, tmp); }
+    return *d;
+}
+
+/* where a store is about to write, -1 for anything else. the pointer of an
+   STI is taken from memory, a device register there is read as it was last
+   stored */
+inline int32_t trace_store(const Vm& vm, const decoded& d)
+{
+    switch (d.instr >> 12)
+    {
+        case OP_ST: return d.pc_plus_off;
+        case OP_STI: return vm.memory[d.pc_plus_off];
+        case OP_STR: return (uint16_t)(vm.cpu.reg[d.r1] + d.base_off);
+    }
+    return -1;
+}
+
+inline void run_traced(Vm& vm, uint64_t limit)
+{
+    trace_state& t = *vm.trace;
+    decoded tmp;
+    while (vm.running && vm.cpu.cycles < limit)
+    {
+        if (vm.cpu.cycles >= t.next_checkpoint) { trace_checkpoint(vm); }
+        trace_reserve(vm);
+        uint16_t before[TRACE_SLOTS];
+        trace_slots(vm, before);
+        const decoded& d = trace_fetch(vm, tmp);
+        if (d.op == OP_BREAK && debug_stop(vm))
+        {
+            --vm.cpu.reg[R_PC];
+            break;
+        }
+        uint16_t instr = d.instr;
+        uint16_t r0 = d.r0;
+        int32_t store = trace_store(vm, d);
+        op_table[instr >> 12](vm, d);
+        ++vm.cpu.cycles;
+
+        uint16_t write[2] = { (uint16_t)store, vm.cpu.reg[r0] };
+        trace_record(vm, 0, instr, before, write, store >= 0);
+    }
+}
+
+/* the words the interrupt pushed, and the key it latched */
+inline void trace_interrupt(Vm& vm, uint8_t vector)
+{
+    trace_reserve(vm);
+    uint16_t before[TRACE_SLOTS];
+    trace_slots(vm, before);
+    interrupt_enter(vm, vector, INTERRUPT_PRIORITY);
+    uint16_t sp = vm.cpu.reg[R_R6];
+    uint16_t write[2 * TRACE_WRITES] = {
+        sp, vm.memory[sp], (uint16_t)(sp + 1), vm.memory[(uint16_t)(sp + 1)],
+        MR_KBSR, vm.memory[MR_KBSR], MR_KBDR, vm.memory[MR_KBDR]
+    };
+    trace_record(vm, TRACE_EVENT, vector, before, write, vector == INT_KEYBOARD ? 4 : 2);
+}
+
+inline int Vm::enable_trace(const char* path, uint64_t interval)
+{
+    if (!disable_trace()) { return 0; }
+    FILE* out = NULL;
+    if (path)
+    {
+        if (!(out = fopen(path, "wb"))) { return 0; }
+        fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC), 1, out);
+    }
+    trace = new trace_state;
+    trace->out = out;
+    trace->interval = interval ? interval : (uint64_t)TRACE_INTERVAL;
+    if (out) { trace->writer = std::thread(trace_writer, trace); }
+    trace_begin(*trace, TRACE_RECORDS, *this);
+    trace_checkpoint(*this);
+    return 1;
+}
+
+inline int Vm::disable_trace()
+{
+    if (!trace) { return 1; }
+    if (!trace->out)
+    {
+        delete trace;
+        trace = NULL;
+        return 1;
+    }
+    trace_checkpoint(*this);
+    {
+        std::lock_guard<std::mutex> guard(trace->lock);
+        trace->closing = true;
+    }
+    trace->ready.notify_one();
+    trace->writer.join();
+    int ok = !trace->failed;
+    if (fclose(trace->out) != 0) { ok = 0; }
+    delete trace;
+    trace = NULL;
+    return ok;
+}
+
+/* Trace Replay */
+/* checks a trace against the machine it came from. every checkpoint that
+   has records after it starts a segment, and the segments run on their
+   own threads: each one loads its checkpoint, runs the instructions the
+   records name and compares what they changed. what the machine read from
+   outside is taken from the trace instead of being run again, that is
+   TRAPs, loads from device space and interrupts. a segment that reaches
+   the next checkpoint has to arrive at its registers and memory too */
+struct trace_segment
+{
+    size_t checkpoint;  /* index of its frame */
+    size_t end;         /* of the next checkpoint, or the frame count */
+    uint64_t first;     /* cpu.cycles at the checkpoint */
+    uint64_t verified = 0;
+    std::string error;  /* empty while every record matched */
+};
+
+struct trace_replay_report
+{
+    std::string error;  /* the file itself could not be read */
+    std::vector<trace_segment> segments;
+    uint64_t verified = 0;
+    unsigned threads = 0;
+};
+
+struct trace_frame_ref
+{
+    trace_frame frame;
+    size_t offset;      /* of its packed bytes in the file */
+};
+
+/* one record as it was written */
+struct trace_entry
+{
+    uint8_t flags;
+    uint16_t word;
+    uint16_t mask;
+    uint16_t slots[TRACE_SLOTS];
+    uint8_t writes;
+    uint16_t write[2 * TRACE_WRITES];
+};
+
+inline bool trace_get16(const std::string& s, size_t& at, uint16_t& v)
+{
+    if (s.size() - at < 2) { return false; }
+    v = (uint8_t)s[at] | (uint8_t)s[at + 1] << 8;
+    at += 2;
+    return true;
+}
+
+inline bool trace_next(const std::string& s, size_t& at, trace_entry& e)
+{
+    if (at >= s.size()) { return false; }
+    e.flags = s[at++];
+    if (e.flags & TRACE_EVENT)
+    {
+        if (at >= s.size()) { return false; }
+        e.word = (uint8_t)s[at++];
+    }
+    else if (!trace_get16(s, at, e.word))
+    {
+        return false;
+    }
+    e.mask = 0;
+    if ((e.flags & TRACE_REGS) && !trace_get16(s, at, e.mask)) { return false; }
+    for (int i = 0; i < TRACE_SLOTS; ++i)
+    {
+        if ((e.mask >> i & 1) && !trace_get16(s, at, e.slots[i])) { return false; }
+    }
+    e.writes = 0;
+    if (e.flags & TRACE_WRITE)
+    {
+        if (at >= s.size()) { return false; }
+        e.writes = s[at++];
+        if (e.writes > TRACE_WRITES) { return false; }
+        for (unsigned i = 0; i < 2u * e.writes; ++i)
+        {
+            if (!trace_get16(s, at, e.write[i])) { return false; }
+        }
+    }
+    return true;
+}
+
+/* the result of these depends on the world outside the machine */
+inline bool trace_external(const Vm& vm, const decoded& d)
+{
+    switch (d.instr >> 12)
+    {
+        case OP_TRAP: return true;
+        case OP_LD: return d.pc_plus_off >= DEVICE_BASE;
+        case OP_LDI: return d.pc_plus_off >= DEVICE_BASE || vm.memory[d.pc_plus_off] >= DEVICE_BASE;
+        case OP_LDR: return (uint16_t)(vm.cpu.reg[d.r1] + d.base_off) >= DEVICE_BASE;
+    }
+    return false;
+}
+
+const char* const trace_slot_names[TRACE_SLOTS] = {
+    "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "PC", "flags", "PSR", "saved SSP", "saved USP"
+};
+
+inline std::string trace_mismatch(const Vm& vm, uint16_t pc, const char* what, uint16_t is, uint16_t want)
+{
+    char line[128];
+    snprintf(line, sizeof(line), "at %llu, x%04X: %s is x%04X, the trace has x%04X",
+             (unsigned long long)vm.cpu.cycles, pc, what, is, want);
+    return line;
+}
+
+/* replays one record, an empty string when it matched */
+inline std::string trace_replay_step(Vm& vm, const trace_entry& e)
+{
+    uint16_t pc = vm.cpu.reg[R_PC];
+    uint16_t want[TRACE_SLOTS];
+    trace_slots(vm, want);
+    bool event = e.flags & TRACE_EVENT;
+    if (!event) { ++want[TRACE_PC]; }
+    for (int i = 0; i < TRACE_SLOTS; ++i)
+    {
+        if (e.mask >> i & 1) { want[i] = e.slots[i]; }
+    }
+
+    decoded d;
+    if (!event)
+    {
+        if (vm.memory[pc] != e.word) { return trace_mismatch(vm, pc, "the instruction", vm.memory[pc], e.word); }
+        decode_table[e.word >> 12](pc + 1, e.word, d);
+        d.instr = e.word;
+    }
+    if (event || trace_external(vm, d))
+    {
+        for (int i = 0; i < TRACE_SLOTS; ++i) { trace_set_slot(vm, i, want[i]); }
+        for (unsigned i = 0; i < e.writes; ++i) { vm.mem_write(e.write[2 * i], e.write[2 * i + 1]); }
+    }
+    else
+    {
+        decoded tmp;
+        const decoded& run = trace_fetch(vm, tmp);
+        engine_ops<replay_policy>::table[run.instr >> 12](vm, run);
+        uint16_t is[TRACE_SLOTS];
+        trace_slots(vm, is);
+        for (int i = 0; i < TRACE_SLOTS; ++i)
+        {
+            if (is[i] != want[i]) { return trace_mismatch(vm, pc, trace_slot_names[i], is[i], want[i]); }
+        }
+        for (unsigned i = 0; i < e.writes; ++i)
+        {
+            uint16_t address = e.write[2 * i];
+            if (vm.memory[address] != e.write[2 * i + 1])
+            {
+                return trace_mismatch(vm, pc, "the word stored", vm.memory[address], e.write[2 * i + 1]);
+            }
+        }
+    }
+    if (e.flags & TRACE_HALT) { vm.running = false; }
+    if (!event) { ++vm.cpu.cycles; }
+    return std::string();
+}
+
+/* the registers and memory below device space have to be those of the
+   checkpoint that ends the segment */
+inline std::string trace_compare(const Vm& vm, const std::string& snap)
+{
+    snapshot_header h;
+    if (snap.size() < sizeof(h)) { return "a checkpoint is cut short"; }
+    memcpy(&h, snap.data(), sizeof(h));
+    if (h.cycles != vm.cpu.cycles) { return "the next checkpoint is at a different instruction"; }
+    for (int r = 0; r <= R_PC; ++r)
+    {
+        if (h.reg[r] != vm.cpu.reg[r])
+        {
+            return trace_mismatch(vm, vm.cpu.reg[R_PC], trace_slot_names[r], vm.cpu.reg[r], h.reg[r]);
+        }
+    }
+
+    static const uint8_t zero[IMAGE_PAGE] = {};
+    const uint8_t* mem = (const uint8_t*)vm.memory;
+    const char* data = snap.data() + sizeof(h);
+    for (int p = 0; p < SNAPSHOT_PAGES; ++p)
+    {
+        size_t start = p * IMAGE_PAGE;
+        size_t end = start + IMAGE_PAGE < 2 * DEVICE_BASE ? start + IMAGE_PAGE : 2 * DEVICE_BASE;
+        const uint8_t* page = zero;
+        if (h.pages >> p & 1)
+        {
+            if ((size_t)(data + IMAGE_PAGE - snap.data()) > snap.size()) { return "a checkpoint is cut short"; }
+            page = (const uint8_t*)data;
+            data += IMAGE_PAGE;
+        }
+        if (start >= end || memcmp(mem + start, page, end - start) == 0) { continue; }
+        for (size_t i = start; i < end; i += 2)
+        {
+            if (memcmp(mem + i, page + i - start, 2) != 0)
+            {
+                uint16_t is, want;
+                memcpy(&is, mem + i, 2);
+                memcpy(&want, page + i - start, 2);
+                char what[32];
+                snprintf(what, sizeof(what), "the word at x%04X", (unsigned)(i / 2));
+                return trace_mismatch(vm, vm.cpu.reg[R_PC], what, is, want);
+            }
+        }
+    }
+    return std::string();
+}
+
+inline void trace_replay_segment(const std::string& file, const std::vector<trace_frame_ref>& frames,
+                                 trace_segment& seg)
+{
+    std::string data;
+    const trace_frame_ref& cp = frames[seg.checkpoint];
+    if (!lz_unpack((const uint8_t*)file.data() + cp.offset, cp.frame.packed, cp.frame.raw, data))
+    {
+        seg.error = "a checkpoint does not unpack";
+        return;
+    }
+    Vm vm;
+    buffer_io io;
+    vm.io = &io;
+    if (!load_snapshot(vm, (const uint8_t*)data.data(), data.size()))
+    {
+        seg.error = "a checkpoint does not load";
+        return;
+    }
+    /* nothing outside the machine takes part, the trace stands in for it */
+    memset(vm.devices, 0, sizeof(vm.devices));
+    vm.irq = interrupt_state();
+
+    for (size_t f = seg.checkpoint + 1; f < seg.end; ++f)
+    {
+        const trace_frame_ref& r = frames[f];
+        if (r.frame.first != vm.cpu.cycles || r.frame.pc != vm.cpu.reg[R_PC])
+        {
+            seg.error = trace_mismatch(vm, vm.cpu.reg[R_PC], "where a chunk starts", vm.cpu.reg[R_PC], r.frame.pc);
+            return;
+        }
+        if (!lz_unpack((const uint8_t*)file.data() + r.offset, r.frame.packed, r.frame.raw, data))
+        {
+            seg.error = "a chunk of records does not unpack";
+            return;
+        }
+        size_t at = 0;
+        trace_entry e;
+        for (uint32_t i = 0; i < r.frame.records; ++i)
+        {
+            if (!trace_next(data, at, e))
+            {
+                seg.error = "a record is cut short";
+                return;
+            }
+            seg.error = trace_replay_step(vm, e);
+            if (!seg.error.empty()) { return; }
+            ++seg.verified;
+        }
+    }
+    if (seg.end < frames.size())
+    {
+        const trace_frame_ref& next = frames[seg.end];
+        if (!lz_unpack((const uint8_t*)file.data() + next.offset, next.frame.packed, next.frame.raw, data))
+        {
+            seg.error = "a checkpoint does not unpack";
+            return;
+        }
+        seg.error = trace_compare(vm, data);
+    }
+}
+
+/* 0 if the file cannot be read, otherwise report says how every segment went */
+inline int trace_replay(const char* path, unsigned threads, trace_replay_report& report)
+{
+    std::string file;
+    FILE* in = fopen(path, "rb");
+    if (in)
+    {
+        char buf[1 << 16];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), in)) > 0) { file.append(buf, n); }
+        fclose(in);
+    }
+    if (file.size() < sizeof(TRACE_MAGIC) || memcmp(file.data(), TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0)
+    {
+        report.error = std::string("not a trace: ") + path;
+        return 0;
+    }
+
+    std::vector<trace_frame_ref> frames;
+    size_t at = sizeof(TRACE_MAGIC);
+    while (file.size() - at >= sizeof(trace_frame))
+    {
+        trace_frame_ref r;
+        memcpy(&r.frame, file.data() + at, sizeof(r.frame));
+        r.offset = at + sizeof(r.frame);
+        if (r.frame.packed > file.size() - r.offset) { break; }
+        frames.push_back(r);
+        at = r.offset + r.frame.packed;
+    }
+    if (at != file.size())
+    {
+        report.error = std::string("the trace is cut short: ") + path;
+        return 0;
+    }
+
+    for (size_t f = 0; f < frames.size(); ++f)
+    {
+        if (frames[f].frame.kind != TRACE_CHECKPOINT) { continue; }
+        size_t end = f + 1;
+        while (end < frames.size() && frames[end].frame.kind != TRACE_CHECKPOINT) { ++end; }
+        if (end == f + 1) { continue; }
+        trace_segment seg;
+        seg.checkpoint = f;
+        seg.end = end;
+        seg.first = frames[f].frame.first;
+        report.segments.push_back(seg);
+    }
+
+    if (threads == 0) { threads = std::thread::hardware_concurrency(); }
+    if (threads == 0) { threads = 1; }
+    if (threads > report.segments.size()) { threads = report.segments.size() ? report.segments.size() : 1; }
+    report.threads = threads;
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        workers.emplace_back([&] {
+            for (size_t s; (s = next.fetch_add(1)) < report.segments.size();)
+            {
+                trace_replay_segment(file, frames, report.segments[s]);
+            }
+        });
+    }
+    for (std::thread& w : workers) { w.join(); }
+    for (const trace_segment& seg : report.segments) { report.verified += seg.verified; }
+    return 1;
+}
+
+/* Debugger */
+/* a stub for gdb's remote serial protocol. the registers go over the wire
+   in the order of R_R0..R_COND, 16 bits each, and an address is a word of
+   the guest's memory, which reads and writes as two bytes, low first.
+   while gdb is attached the machine keeps a trace in memory, and going
+   back means loading the last checkpoint before the point wanted and
+   replaying the records up to it */
+enum
+{
+    DEBUG_INTERVAL = 1 << 18,  /* instructions between checkpoints while debugging */
+    DEBUG_SLICE = 1 << 14,     /* instructions between looks for gdb's interrupt */
+    DEBUG_PACKET = 0x1000
+};
+
+enum gdb_result { GDB_DETACH, GDB_KILL };
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+inline debug_state& Vm::enable_debug()
+{
+    if (!debug)
+    {
+        debug = new debug_state;
+        /* the superinstructions made so far could run over a breakpoint */
+        decode_cache_reset(*this);
+        jit_free(jit);
+        jit = NULL;
+    }
+    return *debug;
+}
+
+/* a word stored from outside: no device sees it, and whatever was decoded
+   from it goes. a trace takes a checkpoint after anything like it, its
+   records could not replay over the change */
+inline void debug_poke(Vm& vm, uint16_t address, uint16_t val)
+{
+    vm.memory[address] = val;
+    decode_cache_invalidate(vm, address);
+}
+
+/* plays the records of a chunk from the start until the machine is about
+   to run instruction target, the interrupts taken in front of it
+   included. returns where it stopped in the data */
+inline size_t trace_play(Vm& vm, const trace_chunk& c, uint64_t target, uint32_t& played)
+{
+    size_t at = 0;
+    trace_entry e;
+    for (played = 0; played < c.frame.records; ++played)
+    {
+        size_t mark = at;
+        if (!trace_next(c.data, at, e)) { break; }
+        if (vm.cpu.cycles >= target && !(e.flags & TRACE_EVENT)) { return mark; }
+        trace_replay_step(vm, e);
+    }
+    return at;
+}
+
+/* takes the machine back to just before instruction target ran, with
+   nothing outside it seeing the replay. the records after that are
+   dropped and running on records them again. 0 if the trace in memory
+   does not reach back that far */
+inline int trace_rewind(Vm& vm, uint64_t target)
+{
+    trace_state& t = *vm.trace;
+    if (t.out) { return 0; }
+    if (t.open.frame.records) { trace_submit(t); }
+    size_t k = t.kept.size();
+    for (size_t f = 0; f < t.kept.size(); ++f)
+    {
+        if (t.kept[f].frame.kind == TRACE_CHECKPOINT && t.kept[f].frame.first <= target) { k = f; }
+    }
+    if (k == t.kept.size())
+    {
+        trace_begin(t, TRACE_RECORDS, vm);
+        return 0;
+    }
+
+    device_page devices[DEVICE_PAGES];
+    memcpy(devices, vm.devices, sizeof(devices));
+    const std::string& snap = t.kept[k].data;
+    load_snapshot(vm, (const uint8_t*)snap.data(), snap.size());
+    memset(vm.devices, 0, sizeof(vm.devices));
+    decode_cache_reset(vm);
+
+    size_t f = k + 1;
+    while (f < t.kept.size())
+    {
+        trace_chunk& c = t.kept[f++];
+        if (c.frame.kind == TRACE_CHECKPOINT) { continue; }
+        uint32_t played;
+        size_t at = trace_play(vm, c, target, played);
+        if (played < c.frame.records)
+        {
+            t.kept_bytes -= c.data.size() - at;
+            c.data.resize(at);
+            c.frame.records = played;
+            break;
+        }
+    }
+    for (size_t i = f; i < t.kept.size(); ++i) { t.kept_bytes -= t.kept[i].data.size(); }
+    t.kept.erase(t.kept.begin() + f, t.kept.end());
+    memcpy(vm.devices, devices, sizeof(devices));
+    trace_begin(t, TRACE_RECORDS, vm);
+    t.next_checkpoint = t.kept[k].frame.first + t.interval;
+    return 1;
+}
+
+/* the last instruction before the current one that ran with the PC on a
+   breakpoint, found by replaying the trace in memory on a machine of its
+   own. UINT64_MAX if none did since the oldest checkpoint */
+inline uint64_t trace_find_break(Vm& vm)
+{
+    trace_state& t = *vm.trace;
+    uint64_t found = UINT64_MAX;
+    if (t.out) { return found; }
+    if (t.open.frame.records)
+    {
+        trace_submit(t);
+        trace_begin(t, TRACE_RECORDS, vm);
+    }
+    Vm scan;
+    buffer_io io;
+    scan.io = &io;
+    bool loaded = false;
+    for (const trace_chunk& c : t.kept)
+    {
+        if (c.frame.kind == TRACE_CHECKPOINT)
+        {
+            if (loaded) { continue; }
+            load_snapshot(scan, (const uint8_t*)c.data.data(), c.data.size());
+            memset(scan.devices, 0, sizeof(scan.devices));
+            loaded = true;
+            continue;
+        }
+        if (!loaded) { continue; }
+        size_t at = 0;
+        trace_entry e;
+        for (uint32_t i = 0; i < c.frame.records && scan.cpu.cycles < vm.cpu.cycles; ++i)
+        {
+            if (!trace_next(c.data, at, e)) { break; }
+            if (!(e.flags & TRACE_EVENT) && debug_has(*vm.debug, scan.cpu.reg[R_PC])) { found = scan.cpu.cycles; }
+            trace_replay_step(scan, e);
+        }
+    }
+    return found;
+}
+
+/* the oldest point the trace in memory goes back to */
+inline uint64_t trace_oldest(const Vm& vm)
+{
+    for (const trace_chunk& c : vm.trace->kept)
+    {
+        if (c.frame.kind == TRACE_CHECKPOINT) { return c.frame.first; }
+    }
+    return vm.cpu.cycles;
+}
+
+struct gdb_conn
+{
+    int fd;
+    bool ack = true;
+    char buf[DEBUG_PACKET];
+    size_t at = 0;
+    size_t have = 0;
+};
+
+/* -1 once gdb has gone */
+inline int gdb_getc(gdb_conn& c)
+{
+    while (c.at == c.have)
+    {
+        ssize_t n = recv(c.fd, c.buf, sizeof(c.buf), 0);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return -1; }
+        c.at = 0;
+        c.have = n;
+    }
+    return (uint8_t)c.buf[c.at++];
+}
+
+inline bool gdb_write(gdb_conn& c, const std::string& bytes)
+{
+    for (size_t at = 0; at < bytes.size();)
+    {
+        ssize_t n = send(c.fd, bytes.data() + at, bytes.size() - at, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return false; }
+        at += n;
+    }
+    return true;
+}
+
+inline bool gdb_send(gdb_conn& c, const std::string& data)
+{
+    uint8_t sum = 0;
+    for (char ch : data) { sum += (uint8_t)ch; }
+    char tail[4];
+    snprintf(tail, sizeof(tail), "#%02x", sum);
+    return gdb_write(c, "$" + data + tail);
+}
+
+inline int gdb_hex(int ch)
+{
+    if (ch >= '0' && ch <= '9') { return ch - '0'; }
+    if (ch >= 'a' && ch <= 'f') { return ch - 'a' + 10; }
+    if (ch >= 'A' && ch <= 'F') { return ch - 'A' + 10; }
+    return -1;
+}
+
+/* the next packet, false once gdb has gone. acks and interrupts that
+   arrive while the machine is stopped are dropped */
+inline bool gdb_receive(gdb_conn& c, std::string& p)
+{
+    for (;;)
+    {
+        int ch = gdb_getc(c);
+        if (ch < 0) { return false; }
+        if (ch != '$') { continue; }
+        p.clear();
+        uint8_t sum = 0;
+        while ((ch = gdb_getc(c)) >= 0 && ch != '#')
+        {
+            p += (char)ch;
+            sum += (uint8_t)ch;
+        }
+        int hi = gdb_getc(c);
+        int lo = gdb_getc(c);
+        if (lo < 0) { return false; }
+        bool ok = gdb_hex(hi) << 4 == (sum & 0xF0) && gdb_hex(lo) == (sum & 0x0F);
+        if (c.ack && !gdb_write(c, ok ? "+" : "-")) { return false; }
+        if (ok || !c.ack) { return true; }
+    }
+}
+
+/* gdb sends a lone 0x03 to stop a machine that is running */
+inline bool gdb_interrupted(gdb_conn& c)
+{
+    for (;;)
+    {
+        if (c.at == c.have)
+        {
+            pollfd p = { c.fd, POLLIN, 0 };
+            if (poll(&p, 1, 0) <= 0) { return false; }
+        }
+        int ch = gdb_getc(c);
+        if (ch < 0 || ch == 0x03) { return true; }
+    }
+}
+
+inline uint32_t gdb_number(const std::string& p, size_t& at)
+{
+    uint32_t v = 0;
+    for (int h; at < p.size() && (h = gdb_hex(p[at])) >= 0; ++at) { v = v << 4 | h; }
+    return v;
+}
+
+inline void gdb_put8(std::string& s, uint8_t v)
+{
+    static const char digits[] = "0123456789abcdef";
+    s += digits[v >> 4];
+    s += digits[v & 15];
+}
+
+inline void gdb_put16(std::string& s, uint16_t v)
+{
+    gdb_put8(s, v & 0xFF);
+    gdb_put8(s, v >> 8);
+}
+
+inline bool gdb_get8(const std::string& p, size_t& at, uint8_t& v)
+{
+    if (p.size() - at < 2 || gdb_hex(p[at]) < 0 || gdb_hex(p[at + 1]) < 0) { return false; }
+    v = gdb_hex(p[at]) << 4 | gdb_hex(p[at + 1]);
+    at += 2;
+    return true;
+}
+
+inline bool gdb_get16(const std::string& p, size_t& at, uint16_t& v)
+{
+    uint8_t lo, hi;
+    if (!gdb_get8(p, at, lo) || !gdb_get8(p, at, hi)) { return false; }
+    v = lo | hi << 8;
+    return true;
+}
+
+inline std::string gdb_target()
+{
+    static const char* const names[R_COUNT] = { "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7", "pc", "cond" };
+    std::string xml = "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+                      "<target><feature name=\"org.lc3.core\">";
+    for (int r = R_R0; r < R_COUNT; ++r)
+    {
+        xml += std::string("<reg name=\"") + names[r] + "\" bitsize=\"16\" type=\""
+             + (r == R_PC ? "code_ptr" : "uint16") + "\"/>";
+    }
+    return xml + "</feature></target>";
+}
+
+/* runs until a breakpoint, HALT or gdb's interrupt, or one instruction */
+inline std::string gdb_resume(Vm& vm, gdb_conn& c, bool step)
+{
+    debug_state& g = *vm.debug;
+    if (!vm.running) { return "W00"; }
+    g.hit = false;
+    g.resume = debug_has(g, vm.cpu.reg[R_PC]);
+    bool interrupted = false;
+    do
+    {
+        vm.step(step ? 1 : DEBUG_SLICE);
+        g.resume = false;
+        interrupted = !step && vm.running && gdb_interrupted(c);
+    }
+    while (!step && vm.running && !interrupted);
+    if (g.hit)
+    {
+        g.hit = false;
+        vm.running = true;
+        return "T05swbreak:;";
+    }
+    if (!vm.running) { return "W00"; }
+    return interrupted ? "S02" : "S05";
+}
+
+/* bs and bc, back one instruction or to the last breakpoint passed */
+inline std::string gdb_reverse(Vm& vm, bool step)
+{
+    if (!vm.trace) { return "E01"; }
+    uint64_t target = UINT64_MAX;
+    if (!step) { target = trace_find_break(vm); }
+    else if (vm.cpu.cycles > trace_oldest(vm)) { target = vm.cpu.cycles - 1; }
+    if (target != UINT64_MAX && trace_rewind(vm, target))
+    {
+        return step ? "S05" : "T05swbreak:;";
+    }
+    trace_rewind(vm, trace_oldest(vm));
+    return "T05replaylog:begin;";
+}
+
+inline std::string gdb_memory(Vm& vm, const std::string& p, size_t at, bool write)
+{
+    uint16_t address = gdb_number(p, ++at);
+    if (at >= p.size() || p[at] != ',') { return "E01"; }
+    uint32_t len = gdb_number(p, ++at);
+    std::string reply;
+    if (!write)
+    {
+        if (len > DEBUG_PACKET / 2) { len = DEBUG_PACKET / 2; }
+        for (uint32_t i = 0; i < len; ++i)
+        {
+            uint16_t word = vm.memory[(uint16_t)(address + i / 2)];
+            gdb_put8(reply, i & 1 ? word >> 8 : word & 0xFF);
+        }
+        return reply;
+    }
+    if (at >= p.size() || p[at] != ':') { return "E01"; }
+    ++at;
+    for (uint32_t i = 0; i < len; ++i)
+    {
+        uint8_t byte;
+        if (!gdb_get8(p, at, byte)) { return "E01"; }
+        uint16_t a = address + i / 2;
+        uint16_t word = vm.memory[a];
+        word = i & 1 ? (word & 0x00FF) | byte << 8 : (word & 0xFF00) | byte;
+        debug_poke(vm, a, word);
+    }
+    if (vm.trace) { trace_checkpoint(vm); }
+    return "OK";
+}
+
+inline std::string gdb_query(const std::string& p)
+{
+    if (p.compare(0, 10, "qSupported") == 0)
+    {
+        return "PacketSize=1000;qXfer:features:read+;swbreak+;ReverseStep+;ReverseContinue+;QStartNoAckMode+";
+    }
+    if (p == "qAttached") { return "1"; }
+    if (p == "qfThreadInfo") { return "m1"; }
+    if (p == "qsThreadInfo") { return "l"; }
+    if (p == "qC") { return "QC1"; }
+    const char xfer[] = "qXfer:features:read:target.xml:";
+    if (p.compare(0, sizeof(xfer) - 1, xfer) == 0)
+    {
+        size_t at = sizeof(xfer) - 1;
+        uint32_t offset = gdb_number(p, at);
+        uint32_t len = gdb_number(p, ++at);
+        std::string xml = gdb_target();
+        if (offset >= xml.size()) { return "l"; }
+        std::string part = xml.substr(offset, len);
+        return (offset + part.size() < xml.size() ? "m" : "l") + part;
+    }
+    return std::string();
+}
+
+/* serves gdb on fd until it detaches or kills the machine. breakpoints
+   are gone again afterwards */
+inline gdb_result gdb_serve(Vm& vm, int fd)
+{
+    gdb_conn c;
+    c.fd = fd;
+    debug_state& g = vm.enable_debug();
+    bool recording = !vm.trace;
+    if (recording) { vm.enable_trace(NULL, DEBUG_INTERVAL); }
+    gdb_result result = GDB_DETACH;
+    std::string p;
+    for (bool done = false; !done && gdb_receive(c, p);)
+    {
+        std::string reply;
+        bool no_ack = false;
+        size_t at = 1;
+        switch (p.empty() ? 0 : p[0])
+        {
+            case '?':
+                reply = "S05";
+                break;
+            case 'g':
+                for (int r = R_R0; r < R_COUNT; ++r) { gdb_put16(reply, vm.read_reg(r)); }
+                break;
+            case 'G':
+            {
+                uint16_t v[R_COUNT];
+                reply = "OK";
+                for (int r = R_R0; r < R_COUNT; ++r)
+                {
+                    if (!gdb_get16(p, at, v[r])) { reply = "E01"; }
+                }
+                if (reply == "E01" || !cond_valid(v[R_COND]))
+                {
+                    reply = "E01";
+                    break;
+                }
+                for (int r = R_R0; r < R_COUNT; ++r) { vm.write_reg(r, v[r]); }
+                if (vm.trace) { trace_checkpoint(vm); }
+                break;
+            }
+            case 'p':
+            {
+                uint32_t r = gdb_number(p, at);
+                if (r < R_COUNT) { gdb_put16(reply, vm.read_reg(r)); }
+                else { reply = "E01"; }
+                break;
+            }
+            case 'P':
+            {
+                uint32_t r = gdb_number(p, at);
+                uint16_t v;
+                if (r >= R_COUNT || at >= p.size() || p[at++] != '=' || !gdb_get16(p, at, v)
+                    || !vm.write_reg(r, v))
+                {
+                    reply = "E01";
+                    break;
+                }
+                if (vm.trace) { trace_checkpoint(vm); }
+                reply = "OK";
+                break;
+            }
+            case 'm':
+            case 'M':
+                reply = gdb_memory(vm, p, 0, p[0] == 'M');
+                break;
+            case 'c':
+            case 's':
+                if (p.size() > 1) { vm.cpu.reg[R_PC] = gdb_number(p, at); }
+                reply = gdb_resume(vm, c, p[0] == 's');
+                break;
+            case 'b':
+                if (p == "bs" || p == "bc") { reply = gdb_reverse(vm, p == "bs"); }
+                break;
+            case 'Z':
+            case 'z':
+            {
+                /* software and hardware breakpoints are the same thing here */
+                if (p.size() < 2 || (p[1] != '0' && p[1] != '1')) { break; }
+                at = 3;
+                uint32_t address = gdb_number(p, at);
+                reply = debug_break(vm, address, p[0] == 'Z') ? "OK" : "E01";
+                break;
+            }
+            case 'q':
+                reply = gdb_query(p);
+                break;
+            case 'Q':
+                if (p == "QStartNoAckMode")
+                {
+                    reply = "OK";
+                    no_ack = true;
+                }
+                break;
+            case 'H':
+            case 'T':
+                reply = "OK";
+                break;
+            case 'D':
+                reply = "OK";
+                done = true;
+                break;
+            case 'k':
+                result = GDB_KILL;
+                done = true;
+                continue;
+            case 'v':
+                if (p == "vKill;1")
+                {
+                    reply = "OK";
+                    result = GDB_KILL;
+                    done = true;
+                }
+                break;
+        }
+        if (!gdb_send(c, reply)) { break; }
+        if (no_ack) { c.ack = false; }
+    }
+
+    memset(g.breaks, 0, sizeof(g.breaks));
+    decode_cache_reset(vm);
+    if (recording) { vm.disable_trace(); }
+    return result;
+}
+
+/* waits for one connection on the loopback interface, -1 if none came */
+inline int gdb_accept(uint16_t port)
+{
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) { return -1; }
+    int one = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in a;
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = -1;
+    if (bind(s, (sockaddr*)&a, sizeof(a)) == 0 && listen(s, 1) == 0) { fd = accept(s, NULL, NULL); }
+    close(s);
+    if (fd >= 0) { setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); }
+    return fd;
+}
+
+/* Watchdog */
+/* how a guarded run ended */
+enum { RUN_HALTED, RUN_BUDGET, RUN_TIMEOUT };
+
+struct run_limits
+{
+    uint64_t budget = 0;                 /* instructions from now, 0 for no limit */
+    std::chrono::nanoseconds timeout{0}; /* wall clock, 0 for no limit */
+    uint64_t slice = 1 << 20;            /* instructions between looks at the clock */
+};
+
+/* the budget is the cycle limit run_until already stops at, which compiled
+   code only checks on entering a block. the clock is read once a slice, so
+   neither adds work per instruction. time spent waiting for a key counts,
+   but is only noticed once the guest runs again */
+inline int run_guarded(Vm& vm, const run_limits& limits)
+{
+    auto start = std::chrono::steady_clock::now();
+    uint64_t end = limits.budget && limits.budget < UINT64_MAX - vm.cpu.cycles
+        ? vm.cpu.cycles + limits.budget : UINT64_MAX;
+    bool timed = limits.timeout.count() > 0;
+    while (vm.running && vm.cpu.cycles < end)
+    {
+        uint64_t until = timed && end - vm.cpu.cycles > limits.slice ? vm.cpu.cycles + limits.slice : end;
+        vm.run_until(until);
+        if (timed && vm.running && std::chrono::steady_clock::now() - start >= limits.timeout)
+        {
+            return RUN_TIMEOUT;
+        }
+    }
+    return vm.running ? RUN_BUDGET : RUN_HALTED;
+}
+
+/* the registers and the code around PC, for a guest that had to be stopped */
+inline void dump_state(const Vm& vm, FILE* out)
+{
+    uint16_t pc = vm.read_reg(R_PC);
+    uint16_t cond = vm.read_reg(R_COND);
+    fprintf(out, "PC=x%04X COND=%c cycles=%llu\n", pc,
+            cond == FL_NEG ? 'n' : cond == FL_ZRO ? 'z' : 'p', (unsigned long long)vm.cpu.cycles);
+    for (int r = R_R0; r <= R_R7; ++r)
+    {
+        fprintf(out, "R%d=x%04X%c", r, vm.read_reg(r), r == R_R7 ? '\n' : ' ');
+    }
+    for (int i = -4; i <= 4; ++i)
+    {
+        uint16_t a = pc + i;
+        fprintf(out, "%s x%04X: x%04X\n", i == 0 ? ">" : " ", a, vm.memory[a]);
+    }
+}
+
+/* Wide Engine */
+#if LC3_WIDE
+/* many guests running the same image in lockstep, one 16 bit lane each.
+   the state is kept as structure of arrays, so one instruction runs for
+   every lane sitting at its PC: 16 lanes in an AVX2 register when built
+   with -mavx2, 8 in an SSE2 one otherwise. lanes that branch apart are
+   parked, and the lowest parked PC runs next, which brings loops back
+   together where they exit. */
+#if defined(__AVX2__)
+enum { WIDE_LANES = 16 };
+#else
+enum { WIDE_LANES = 8 };
+#endif
+
+/* helpers taking or passing a vector are always inlined */
+#define WIDE_INLINE inline __attribute__((always_inline))
+
+typedef uint16_t wide_word __attribute__((vector_size(2 * WIDE_LANES)));
+typedef int16_t wide_mask __attribute__((vector_size(2 * WIDE_LANES)));
+
+const wide_word WIDE_BITS = {
+    1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7,
+#if defined(__AVX2__)
+    1 << 8, 1 << 9, 1 << 10, 1 << 11, 1 << 12, 1 << 13, 1 << 14, 1 << 15
+#endif
+};
+
+WIDE_INLINE wide_word wide_splat(uint16_t x)
+{
+    wide_word v = {};
+    return v + x;
+}
+
+/* all ones in the lanes set in bits */
+WIDE_INLINE wide_word wide_lanes(uint16_t bits)
+{
+    return (wide_word)((WIDE_BITS & wide_splat(bits)) != 0);
+}
+
+/* one bit per lane of a comparison */
+WIDE_INLINE uint16_t wide_bits(wide_mask m)
+{
+#if defined(__AVX2__)
+    __m256i v = (__m256i)m;
+    return _mm_movemask_epi8(_mm_packs_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+#elif defined(__SSE2__)
+    return _mm_movemask_epi8(_mm_packs_epi16((__m128i)m, _mm_setzero_si128()));
+#else
+    uint16_t bits = 0;
+    for (int i = 0; i < WIDE_LANES; ++i) { bits |= (m[i] & 1) << i; }
+    return bits;
+#endif
+}
+
+WIDE_INLINE wide_word wide_select(wide_word m, wide_word a, wide_word b)
+{
+    return (a & m) | (b & ~m);
+}
+
+struct wide_vm
+{
+    wide_word* memory;      /* memory[address] holds that word for every lane */
+    wide_word reg[R_COUNT]; /* R_PC is only kept for parked lanes, R_COND is unused */
+    wide_word flag_result;
+    uint16_t active = 0;    /* lanes that have not halted */
+    uint16_t mask = 0;      /* lanes at pc, running together */
+    uint16_t pc = 0;
+    uint64_t steps = 0;     /* instructions issued */
+    uint64_t cycles[WIDE_LANES] = {}; /* instructions retired by each lane */
+    vm_io* io[WIDE_LANES];
+    std::vector<decoded> decode_cache;
+
+    wide_vm();
+    ~wide_vm();
+    wide_vm(const wide_vm&) = delete;
+    /* new only promises 16 byte alignment before C++17 */
+    static void* operator new(size_t size)
+    {
+        void* p;
+        if (posix_memalign(&p, alignof(wide_vm), size) != 0) { throw std::bad_alloc(); }
+        return p;
+    }
+    static void operator delete(void* p) { free(p); }
+    wide_vm& operator=(const wide_vm&) = delete;
+
+    /* the first lanes start as copies of proto, the rest stay halted */
+    void load(const Vm& proto, unsigned lanes);
+
+    /* issues at most n instructions, or until every lane halted */
+    uint64_t run(uint64_t n);
+};
+
+inline wide_vm::wide_vm() : decode_cache(UINT16_MAX + 1)
+{
+    void* m = mmap(NULL, (UINT16_MAX + 1) * sizeof(wide_word), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) { throw std::bad_alloc(); }
+    memory = (wide_word*)m;
+    for (decoded& d : decode_cache) { d.op = OP_DECODE; }
+    for (int i = 0; i < WIDE_LANES; ++i) { io[i] = &console(); }
+}
+
+inline wide_vm::~wide_vm()
+{
+    munmap(memory, (UINT16_MAX + 1) * sizeof(wide_word));
+}
+
+inline void wide_vm::load(const Vm& proto, unsigned lanes)
+{
+    for (uint32_t a = 0; a <= UINT16_MAX; ++a) { memory[a] = wide_splat(proto.memory[a]); }
+    for (int r = 0; r < R_COUNT; ++r) { reg[r] = wide_splat(proto.cpu.reg[r]); }
+    flag_result = wide_splat(proto.cpu.flag_result);
+    active = !proto.running ? 0 : lanes >= WIDE_LANES ? (1u << WIDE_LANES) - 1 : (1u << lanes) - 1;
+    mask = 0;
+}
+
+/* KBSR and KBDR, for each lane in bits */
+inline void wide_device_read(wide_vm& w, uint16_t address, uint16_t bits)
+{
+    if (address != MR_KBSR) { return; }
+    for (; bits; bits &= bits - 1)
+    {
+        int i = __builtin_ctz(bits);
+        if (w.io[i]->ready())
+        {
+            w.memory[MR_KBSR][i] = (1 << 15);
+            w.memory[MR_KBDR][i] = w.io[i]->getc();
+        }
+        else
+        {
+            w.io[i]->flush();
+            w.memory[MR_KBSR][i] = 0;
+        }
+    }
+}
+
+/* the same address in every running lane */
+WIDE_INLINE wide_word wide_load(wide_vm& w, uint16_t address)
+{
+    if (address >= DEVICE_BASE) { wide_device_read(w, address, w.mask); }
+    return w.memory[address];
+}
+
+/* an address per lane, usually all the same */
+WIDE_INLINE wide_word wide_gather(wide_vm& w, wide_word address)
+{
+    uint16_t first = address[__builtin_ctz(w.mask)];
+    if ((wide_bits(address == wide_splat(first)) & w.mask) == w.mask) { return wide_load(w, first); }
+
+    wide_word val = {};
+    for (uint16_t bits = w.mask; bits; bits &= bits - 1)
+    {
+        int i = __builtin_ctz(bits);
+        uint16_t a = address[i];
+        if (a >= DEVICE_BASE) { wide_device_read(w, a, 1 << i); }
+        val[i] = w.memory[a][i];
+    }
+    return val;
+}
+
+/* no device takes writes here, device space stores like memory */
+WIDE_INLINE void wide_store(wide_vm& w, wide_word address, wide_word val)
+{
+    uint16_t first = address[__builtin_ctz(w.mask)];
+    if ((wide_bits(address == wide_splat(first)) & w.mask) == w.mask)
+    {
+        w.memory[first] = wide_select(wide_lanes(w.mask), val, w.memory[first]);
+        return;
+    }
+    for (uint16_t bits = w.mask; bits; bits &= bits - 1)
+    {
+        int i = __builtin_ctz(bits);
+        w.memory[address[i]][i] = val[i];
+    }
+}
+
+/* the running lanes move on to pc + 1, picking up parked lanes waiting there */
+inline void wide_next(wide_vm& w)
+{
+    ++w.pc;
+    if (w.mask != w.active)
+    {
+        w.mask |= wide_bits(w.reg[R_PC] == wide_splat(w.pc)) & w.active;
+    }
+}
+
+/* the running lanes continue at a PC each. if they all agree and nobody
+   is parked they keep going, otherwise the next group is picked */
+WIDE_INLINE void wide_jump(wide_vm& w, wide_word next)
+{
+    uint16_t target = next[__builtin_ctz(w.mask)];
+    uint16_t same = wide_bits(next == wide_splat(target)) & w.mask;
+    if (same == w.mask && w.mask == w.active)
+    {
+        w.pc = target;
+        return;
+    }
+    w.reg[R_PC] = wide_select(wide_lanes(w.mask), next, w.reg[R_PC]);
+    w.mask = 0;
+}
+
+/* runs the lanes with the lowest PC next */
+inline void wide_schedule(wide_vm& w)
+{
+    uint16_t best = 0xFFFF;
+    for (uint16_t bits = w.active; bits; bits &= bits - 1)
+    {
+        uint16_t pc = w.reg[R_PC][__builtin_ctz(bits)];
+        if (pc < best) { best = pc; }
+    }
+    w.pc = best;
+    w.mask = wide_bits(w.reg[R_PC] == wide_splat(best)) & w.active;
+}
+
+/* traps are I/O, so every lane does its own */
+inline void wide_trap(wide_vm& w, const decoded& d)
+{
+    for (uint16_t bits = w.mask; bits; bits &= bits - 1)
+    {
+        int i = __builtin_ctz(bits);
+        vm_io& io = *w.io[i];
+        uint16_t r0 = w.reg[R_R0][i];
+        char buf[256];
+        size_t n = 0;
+        switch (d.instr & 0xFF)
+        {
+            case TRAP_GETC:
+                r0 = (uint16_t)io.getc();
+                w.reg[R_R0][i] = r0;
+                w.flag_result[i] = r0;
+                break;
+            case TRAP_OUT:
+                buf[0] = (char)r0;
+                io.put(buf, 1);
+                break;
+            case TRAP_PUTS:
+                for (uint16_t a = r0; w.memory[a][i]; ++a)
+                {
+                    buf[n++] = (char)w.memory[a][i];
+                    if (n == sizeof(buf))
+                    {
+                        io.put(buf, n);
+                        n = 0;
+                    }
+                }
+                io.put(buf, n);
+                break;
+            case TRAP_IN:
+            {
+                io.put("Enter a character: ", 19);
+                char c = io.getc();
+                io.put(&c, 1);
+                w.reg[R_R0][i] = (uint16_t)c;
+                w.flag_result[i] = (uint16_t)c;
+                break;
+            }
+            case TRAP_PUTSP:
+                for (uint16_t a = r0; w.memory[a][i]; ++a)
+                {
+                    buf[n++] = w.memory[a][i] & 0xFF;
+                    char char2 = w.memory[a][i] >> 8;
+                    if (char2) { buf[n++] = char2; }
+                    if (n >= sizeof(buf) - 1)
+                    {
+                        io.put(buf, n);
+                        n = 0;
+                    }
+                }
+                io.put(buf, n);
+                break;
+            case TRAP_HALT:
+                io.put("HALT\n", 5);
+                io.flush();
+                w.active &= ~(1 << i);
+                break;
+        }
+    }
+}
+
+/* the same step masks as ins, applied to the lanes in mask */
+template <unsigned op>
+void wide_ins(wide_vm& w, const decoded& d)
+{
+    wide_word* reg = w.reg;
+    const wide_word m = wide_lanes(w.mask);
+    uint16_t r0 = d.r0, r1 = d.r1;
+    wide_word val = {}, base_plus_off = {};
+
+    constexpr uint16_t opbit = (1 << op);
+    if (0x00C0 & opbit) { base_plus_off = reg[r1] + d.base_off; }
+    if (0x0002 & opbit) { val = reg[r1] + (d.imm_flag ? wide_splat(d.imm5) : reg[d.r2]); } // ADD
+    if (0x0020 & opbit) { val = reg[r1] & (d.imm_flag ? wide_splat(d.imm5) : reg[d.r2]); } // AND
+    if (0x0200 & opbit) { val = ~reg[r1]; } // NOT
+    if (0x0004 & opbit) { val = wide_load(w, d.pc_plus_off); } // LD
+    if (0x0400 & opbit) { val = wide_gather(w, wide_load(w, d.pc_plus_off)); } // LDI
+    if (0x0040 & opbit) { val = wide_gather(w, base_plus_off); } // LDR
+    if (0x4000 & opbit) { val = wide_splat(d.pc_plus_off); } // LEA
+    if (0x0008 & opbit) { wide_store(w, wide_splat(d.pc_plus_off), reg[r0]); } // ST
+    if (0x0800 & opbit) { wide_store(w, wide_load(w, d.pc_plus_off), reg[r0]); } // STI
+    if (0x0080 & opbit) { wide_store(w, base_plus_off, reg[r0]); } // STR
+    if (0x4666 & opbit)
+    {
+        reg[r0] = wide_select(m, val, reg[r0]);
+        w.flag_result = wide_select(m, val, w.flag_result);
+    }
+
+    if (0x0001 & opbit)  // BR
+    {
+        wide_word f = w.flag_result;
+        wide_word neg = (wide_word)((wide_mask)f < 0);
+        wide_word zero = (wide_word)(f == 0);
+        wide_word take = {};
+        if (d.cond & FL_NEG) { take |= neg; }
+        if (d.cond & FL_ZRO) { take |= zero; }
+        if (d.cond & FL_POS) { take |= ~(neg | zero); }
+        wide_jump(w, wide_select(take, wide_splat(d.pc_plus_off), wide_splat(w.pc + 1)));
+    }
+    else if (0x1000 & opbit) // JMP
+    {
+        wide_jump(w, reg[r1]);
+    }
+    else if (0x0010 & opbit) // JSR
+    {
+        reg[R_R7] = wide_select(m, wide_splat(w.pc + 1), reg[R_R7]);
+        wide_jump(w, d.long_flag ? wide_splat(d.pc_plus_off) : reg[r1]);
+    }
+    else if (0x8000 & opbit) // TRAP
+    {
+        wide_trap(w, d);
+        w.mask &= w.active;
+        if (w.mask) { wide_next(w); }
+    }
+    else
+    {
+        wide_next(w);
+    }
+}
+
+inline void wide_bad(wide_vm& w, const decoded& d)
+{
+    abort();
+}
+
+static void (*wide_table[16])(wide_vm&, const decoded&) = {
+    wide_ins<0>, wide_ins<1>, wide_ins<2>, wide_ins<3>,
+    wide_ins<4>, wide_ins<5>, wide_ins<6>, wide_ins<7>,
+    wide_bad, wide_ins<9>, wide_ins<10>, wide_ins<11>,
+    wide_ins<12>, wide_bad, wide_ins<14>, wide_ins<15>
+};
+
+inline void wide_charge(wide_vm& w, uint16_t bits, uint64_t n)
+{
+    for (; bits; bits &= bits - 1) { w.cycles[__builtin_ctz(bits)] += n; }
+}
+
+inline uint64_t wide_vm::run(uint64_t n)
+{
+    uint64_t done = 0;
+    uint16_t run_mask = 0; /* retired counts are charged per run of one mask */
+    uint64_t run_length = 0;
+    while (done < n)
+    {
+        if (!mask)
+        {
+            if (!active) { break; }
+            wide_schedule(*this);
+        }
+
+        /* a lane whose word differs, after a store to code, waits its turn */
+        wide_word row = memory[pc];
+        uint16_t instr = row[__builtin_ctz(mask)];
+        uint16_t same = wide_bits(row == wide_splat(instr)) & mask;
+        if (same != mask)
+        {
+            reg[R_PC] = wide_select(wide_lanes(mask & ~same), wide_splat(pc), reg[R_PC]);
+            mask = same;
+        }
+
+        if (mask != run_mask)
+        {
+            wide_charge(*this, run_mask, run_length);
+            run_mask = mask;
+            run_length = 0;
+        }
+        ++run_length;
+        ++done;
+
+        decoded& d = decode_cache[pc];
+        if (d.op == OP_DECODE || d.instr != instr)
+        {
+            decode_table[instr >> 12](pc + 1, instr, d);
+            d.op = instr >> 12;
+        }
+        wide_table[d.op](*this, d);
+    }
+    wide_charge(*this, run_mask, run_length);
+    if (mask) { reg[R_PC] = wide_select(wide_lanes(mask), wide_splat(pc), reg[R_PC]); }
+    steps += done;
+    return done;
+}
+#endif
+
+/* Batch Runner */
+/* many independent guests on a pool of threads. each job runs a quantum
+   at a time so long guests do not hold up short ones, and a worker that
+   runs dry steals jobs from the others */
+enum { BATCH_PENDING, BATCH_HALTED, BATCH_LIMIT, BATCH_TIMEOUT, BATCH_FAILED };
+
+struct batch_job
+{
+    std::vector<std::string> images;
+    std::vector<std::string> sources; /* assembly text, assembled in memory after the images */
+    buffer_io io;
+    int status = BATCH_PENDING;
+    std::string error;                /* why it failed */
+    uint64_t cycles = 0;
+    uint16_t pc = 0;                  /* where a guest that was stopped stood */
+    std::chrono::nanoseconds elapsed{0}; /* time spent in its slices */
+    std::unique_ptr<Vm> vm; /* only while the job is running */
+    vm_metrics metrics;     /* kept when the batch counts them */
+    metered_io meter;
+};
+
+struct batch_options
+{
+    unsigned threads = 0;       /* 0 for one per core */
+    uint64_t quantum = 1 << 20; /* instructions per slice */
+    uint64_t max_cycles = 0;    /* 0 for no limit, for a wide group it caps lockstep steps */
+    std::chrono::nanoseconds timeout{0}; /* run time per job, 0 for no limit */
+    unsigned decode_pages = 0;  /* decode cache pages per job, 0 for no limit */
+    size_t max_output = 16 << 20; /* bytes of output kept per job, past it the job ends, 0 for no limit */
+    bool allow_overlap = false; /* images of a job may cover the same words, later ones win */
+    bool jit = false;
+    bool wide = false;          /* jobs with the same images share a wide_vm */
+    bool metrics = false;       /* count into the metrics of each job, see Metrics */
+};
+
+/* what a worker schedules: one job, or jobs with the same images that
+   run in lockstep */
+struct batch_unit
+{
+    std::vector<size_t> jobs;
+#if LC3_WIDE
+    std::unique_ptr<wide_vm> wide;
+    std::chrono::nanoseconds elapsed{0};
+#endif
+};
+
+/* jobs a worker keeps in flight, which bounds the live VMs */
+enum { BATCH_ACTIVE = 4 };
+
+struct batch_worker
+{
+    std::mutex lock;
+    std::deque<size_t> units; /* the owner takes from the back, thieves from the front */
+};
+
+/* the workers are already one per core, so a job plans its images on its own thread */
+inline int batch_load(Vm& vm, batch_job& job, const batch_options& opt)
+{
+    image_plan plan;
+    if ((!plan_images(plan, job.images, 1) && (plan.failed != SIZE_MAX || !opt.allow_overlap))
+        || !vm.load_images(plan, 1))
+    {
+        job.error = plan_error(plan);
+        return 0;
+    }
+    asm_image img;
+    for (const std::string& source : job.sources)
+    {
+        if (!assemble(source.data(), source.size(), img) || !load_asm_image(vm, img))
+        {
+            job.error = "failed to assemble: " + img.error;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* the io a job's guest sees, counted when the batch keeps metrics */
+inline vm_io* batch_io(batch_job& job, const batch_options& opt)
+{
+    if (opt.max_output) { job.io.out_limit = opt.max_output; }
+    if (!opt.metrics) { return &job.io; }
+    job.meter.io = &job.io;
+    job.meter.metrics = &job.metrics;
+    return &job.meter;
+}
+
+/* runs one quantum, true once the job is finished */
+inline bool batch_slice(batch_job& job, const batch_options& opt)
+{
+    if (!job.vm)
+    {
+        job.vm.reset(new Vm);
+        job.vm->io = batch_io(job, opt);
+        if (opt.metrics) { job.vm->metrics = &job.metrics; }
+        job.vm->decode_limit(opt.decode_pages);
+        if (!batch_load(*job.vm, job, opt))
+        {
+            job.status = BATCH_FAILED;
+            job.vm.reset();
+            return true;
+        }
+        if (opt.jit) { job.vm->enable_jit(); }
+        job.vm->specialize();
+    }
+
+    Vm& vm = *job.vm;
+    uint64_t until = vm.cpu.cycles + opt.quantum;
+    if (opt.max_cycles && until > opt.max_cycles) { until = opt.max_cycles; }
+    auto start = std::chrono::steady_clock::now();
+    vm.run_until(until);
+    job.elapsed += std::chrono::steady_clock::now() - start;
+
+    /* a guest that spins printing at the end of its input fills its
+       output, one slice past the limit at most */
+    bool over = (opt.max_cycles && vm.cpu.cycles >= opt.max_cycles) || job.io.full;
+    bool late = opt.timeout.count() && job.elapsed >= opt.timeout;
+    if (vm.running && !over && !late) { return false; }
+    job.status = !vm.running ? BATCH_HALTED : over ? BATCH_LIMIT : BATCH_TIMEOUT;
+    job.cycles = vm.cpu.cycles;
+    job.pc = vm.read_reg(R_PC);
+    job.vm.reset();
+    return true;
+}
+
+#if LC3_WIDE
+inline bool batch_wide_slice(std::vector<batch_job>& jobs, batch_unit& unit, const batch_options& opt)
+{
+    if (!unit.wide)
+    {
+        Vm proto;
+        if (!batch_load(proto, jobs[unit.jobs[0]], opt))
+        {
+            for (size_t job : unit.jobs)
+            {
+                jobs[job].status = BATCH_FAILED;
+                jobs[job].error = jobs[unit.jobs[0]].error;
+            }
+            return true;
+        }
+        unit.wide.reset(new wide_vm);
+        unit.wide->load(proto, unit.jobs.size());
+        for (size_t i = 0; i < unit.jobs.size(); ++i) { unit.wide->io[i] = batch_io(jobs[unit.jobs[i]], opt); }
+    }
+
+    wide_vm& w = *unit.wide;
+    uint64_t n = opt.quantum;
+    if (opt.max_cycles && n > opt.max_cycles - w.steps) { n = opt.max_cycles - w.steps; }
+    auto start = std::chrono::steady_clock::now();
+    w.run(n);
+    unit.elapsed += std::chrono::steady_clock::now() - start;
+    /* a lane counts its instructions, its time and its io, the wide engine has none of the other hooks */
+    if (opt.metrics)
+    {
+        for (size_t i = 0; i < unit.jobs.size(); ++i) { jobs[unit.jobs[i]].metrics.slice(w.cycles[i], start); }
+    }
+
+    /* lanes cannot stop on their own, so the group ends once every lane
+       still running has filled its output */
+    bool full = w.active != 0;
+    for (size_t i = 0; i < unit.jobs.size(); ++i)
+    {
+        if (((w.active >> i) & 1) && !jobs[unit.jobs[i]].io.full) { full = false; }
+    }
+    bool over = opt.max_cycles && w.steps >= opt.max_cycles;
+    bool late = opt.timeout.count() && unit.elapsed >= opt.timeout;
+    if (w.active && !over && !late && !full) { return false; }
+    for (size_t i = 0; i < unit.jobs.size(); ++i)
+    {
+        batch_job& job = jobs[unit.jobs[i]];
+        job.status = !((w.active >> i) & 1) ? BATCH_HALTED : over || job.io.full ? BATCH_LIMIT : BATCH_TIMEOUT;
+        job.cycles = w.cycles[i];
+        job.pc = (w.mask >> i) & 1 ? w.pc : w.reg[R_PC][i];
+        job.elapsed = unit.elapsed;
+    }
+    unit.wide.reset();
+    return true;
+}
+#endif
+
+inline bool batch_unit_slice(std::vector<batch_job>& jobs, batch_unit& unit, const batch_options& opt)
+{
+#if LC3_WIDE
+    if (unit.jobs.size() > 1) { return batch_wide_slice(jobs, unit, opt); }
+#endif
+    return batch_slice(jobs[unit.jobs[0]], opt);
+}
+
+/* groups jobs loading the same images, up to a wide_vm each */
+inline std::vector<batch_unit> batch_units(const std::vector<batch_job>& jobs, const batch_options& opt)
+{
+    std::vector<batch_unit> units;
+    std::map<std::vector<std::string>, size_t> open;
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+#if LC3_WIDE
+        if (opt.wide)
+        {
+            auto it = open.find(jobs[i].images);
+            if (it != open.end() && units[it->second].jobs.size() < WIDE_LANES)
+            {
+                units[it->second].jobs.push_back(i);
+                continue;
+            }
+            open[jobs[i].images] = units.size();
+        }
+#endif
+        units.emplace_back();
+        units.back().jobs.push_back(i);
+    }
+    return units;
+}
+
+/* SIZE_MAX when there is nothing to run right now */
+inline size_t batch_take(std::vector<batch_worker>& workers, unsigned self,
+                         std::atomic<size_t>& next, size_t count)
+{
+    batch_worker& own = workers[self];
+    {
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (own.units.size() < BATCH_ACTIVE && next.load(std::memory_order_relaxed) < count)
+        {
+            size_t unit = next.fetch_add(1, std::memory_order_relaxed);
+            if (unit < count) { return unit; }
+        }
+        if (!own.units.empty())
+        {
+            size_t unit = own.units.back();
+            own.units.pop_back();
+            return unit;
+        }
+    }
+    for (unsigned i = 1; i < workers.size(); ++i)
+    {
+        batch_worker& victim = workers[(self + i) % workers.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.units.empty())
+        {
+            size_t unit = victim.units.front();
+            victim.units.pop_front();
+            return unit;
+        }
+    }
+    return SIZE_MAX;
+}
+
+inline void run_batch(std::vector<batch_job>& jobs, const batch_options& opt)
+{
+    unsigned threads = opt.threads ? opt.threads : std::thread::hardware_concurrency();
+    if (threads == 0) { threads = 1; }
+    std::vector<batch_worker> workers(threads);
+    std::vector<batch_unit> units = batch_units(jobs, opt);
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> left{units.size()};
+
+    auto work = [&](unsigned self)
+    {
+        while (left.load(std::memory_order_acquire))
+        {
+            size_t unit = batch_take(workers, self, next, units.size());
+            if (unit == SIZE_MAX)
+            {
+                /* the last few jobs are running elsewhere */
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                continue;
+            }
+            if (batch_unit_slice(jobs, units[unit], opt))
+            {
+                left.fetch_sub(1, std::memory_order_release);
+                continue;
+            }
+            /* back in line behind the jobs this worker already has */
+            std::lock_guard<std::mutex> guard(workers[self].lock);
+            workers[self].units.push_front(unit);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; ++i) { pool.emplace_back(work, i); }
+    work(0);
+    for (std::thread& t : pool) { t.join(); }
+}
+
+/* Fuzzing */
+/* runs one warm machine on input after input, the way libFuzzer or AFL
+   drive a target. the bytes are the keys the guest reads, through KBSR
+   and KBDR or GETC, and a run ends when the guest wants more than there
+   is, halts, faults or runs out of budget. every BR, JMP and JSR counts
+   the edge it took in a map of 8 bit counters, hashed from the last
+   target and the new one as AFL does. the reserved opcode and RTI in user
+   mode are the faults. between inputs only the pages a store went to are
+   put back, so a short run costs what it ran instead of 128 KiB */
+enum
+{
+    FUZZ_MAP = 1 << 16,     /* counters in the edge map */
+    FUZZ_BUDGET = 1 << 20,  /* instructions an input may run */
+    FUZZ_POLLS = 64,        /* KBSR polls with no key left before the run ends */
+    FUZZ_MAX_INPUT = 4096   /* bytes fuzz_mutate grows an input to */
+};
+
+enum fuzz_result { FUZZ_DONE, FUZZ_HANG, FUZZ_FAULT };
+
+struct fuzz_state
+{
+    uint8_t* edges;
+    uint16_t prev = 0;    /* the last edge's target, shifted so A->B and B->A differ */
+    int fault = -1;       /* the vector of the fault that stopped the run */
+    uint16_t fault_pc = 0;
+};
+
+/* the input as keys. output is not looked at */
+struct fuzz_io final : vm_io
+{
+    Vm* vm = NULL;
+    const uint8_t* data = NULL;
+    size_t size = 0;
+    size_t pos = 0;
+    unsigned polls = 0;
+
+    bool ready() override
+    {
+        if (pos < size) { return true; }
+        if (++polls >= FUZZ_POLLS) { vm->running = false; }
+        return false;
+    }
+    int getc() override
+    {
+        if (pos < size) { return data[pos++]; }
+        vm->running = false;
+        return EOF;
+    }
+    void put(const char* s, size_t n) override {}
+};
+
+struct fuzz_probe : no_probe
+{
+    static const bool faults = true;
+    static void edge(Vm& vm, uint16_t to)
+    {
+        fuzz_state& f = *vm.fuzz;
+        ++f.edges[(f.prev ^ to) & (FUZZ_MAP - 1)];
+        f.prev = to >> 1;
+    }
+    static void fault(Vm& vm, uint8_t vector)
+    {
+        vm.fuzz->fault = vector;
+        vm.fuzz->fault_pc = vm.cpu.reg[R_PC] - 1;
+        vm.running = false;
+    }
+};
+
+typedef engine_policy<mmio_memory, fuzz_probe, fixed_io<fuzz_io>> fuzz_policy;
+
+struct fuzz_target
+{
+    std::unique_ptr<Vm> vm;
+    std::shared_ptr<vm_snapshot> warm;
+    const uint16_t* base = NULL;  /* the warm memory, mapped read only */
+    fuzz_state state;
+    fuzz_io io;
+    uint64_t budget = FUZZ_BUDGET;
+    uint8_t map[FUZZ_MAP];        /* the edges, unless the fuzzer keeps its own */
+
+    fuzz_target() {}
+    fuzz_target(const fuzz_target&) = delete;
+    fuzz_target& operator=(const fuzz_target&) = delete;
+    ~fuzz_target()
+    {
+        if (base) { munmap((void*)base, MEMORY_SIZE); }
+    }
+};
+
+/* freezes proto as the machine every input starts from, 0 if it cannot
+   be done or has a display. the edges go to edges, or to t.map. whoever
+   reads them clears them between inputs, as libFuzzer does its own */
+inline int fuzz_open(fuzz_target& t, const Vm& proto, uint8_t* edges = NULL)
+{
+    if (proto.display || !(t.warm = proto.snapshot())) { return 0; }
+    void* base = mmap(NULL, MEMORY_SIZE, PROT_READ, MAP_PRIVATE, t.warm->memory_fd, 0);
+    if (base == MAP_FAILED) { return 0; }
+    t.base = (const uint16_t*)base;
+    t.vm.reset(new Vm(*t.warm));
+    Vm& vm = *t.vm;
+    t.io.vm = &vm;
+    vm.io = &t.io;
+    vm.fuzz = &t.state;
+    vm.engine = run_interpreter<fuzz_policy>;
+    if (!edges) { memset(t.map, 0, sizeof(t.map)); }
+    t.state.edges = edges ? edges : t.map;
+    return 1;
+}
+
+/* puts back the words of the pages a store went to. a word that changed
+   was invalidated by its store, but a superinstruction decoded since may
+   have taken the new value in, so it is invalidated again. the device
+   registers are written around mem_write, and are only a page */
+inline void fuzz_reset(fuzz_target& t)
+{
+    Vm& vm = *t.vm;
+    for (unsigned i = 0; i < DECODE_PAGES / 64; ++i)
+    {
+        for (uint64_t bits = vm.dirty[i]; bits; bits &= bits - 1)
+        {
+            uint16_t page = (uint16_t)((i * 64 + __builtin_ctzll(bits)) << 8);
+            for (unsigned k = 0; k < DECODE_PAGE_WORDS; ++k)
+            {
+                uint16_t a = page + k;
+                if (vm.memory[a] == t.base[a]) { continue; }
+                vm.memory[a] = t.base[a];
+                decode_cache_invalidate(vm, a);
+            }
+        }
+    }
+    vm.clear_dirty();
+    memcpy(vm.memory + DEVICE_BASE, t.base + DEVICE_BASE, (0x10000 - DEVICE_BASE) * sizeof(uint16_t));
+    vm.cpu = t.warm->cpu;
+    vm.running = t.warm->running;
+    vm.irq = t.warm->irq;
+}
+
+inline fuzz_result fuzz_one(fuzz_target& t, const uint8_t* data, size_t size)
+{
+    fuzz_reset(t);
+    t.io.data = data;
+    t.io.size = size;
+    t.io.pos = 0;
+    t.io.polls = 0;
+    t.state.prev = 0;
+    t.state.fault = -1;
+    Vm& vm = *t.vm;
+    vm.run_until(vm.cpu.cycles + t.budget);
+    if (t.state.fault >= 0) { return FUZZ_FAULT; }
+    return vm.running ? FUZZ_HANG : FUZZ_DONE;
+}
+
+/* the classes of AFL, so a loop that goes round once more is nothing new */
+inline uint8_t fuzz_bucket(uint8_t n)
+{
+    return n <= 2 ? n : n == 3 ? 4 : n < 8 ? 8 : n < 16 ? 16 : n < 32 ? 32 : n < 128 ? 64 : 128;
+}
+
+/* adds the classes a run reached to seen, and returns how many were new */
+inline unsigned fuzz_merge(const uint8_t* edges, uint8_t* seen)
+{
+    unsigned fresh = 0;
+    const uint64_t* words = (const uint64_t*)edges;
+    for (unsigned w = 0; w < FUZZ_MAP / 8; ++w)
+    {
+        if (!words[w]) { continue; }
+        for (unsigned i = w * 8; i < w * 8 + 8; ++i)
+        {
+            uint8_t b = fuzz_bucket(edges[i]);
+            if (!b || (seen[i] & b)) { continue; }
+            seen[i] |= b;
+            ++fresh;
+        }
+    }
+    return fresh;
+}
+
+inline uint64_t fuzz_random(uint64_t& state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+/* one to four of the usual byte changes. inserted bytes are mostly
+   printable, since that is what guests compare keys against */
+inline void fuzz_mutate(std::vector<uint8_t>& in, uint64_t& rng, size_t max = FUZZ_MAX_INPUT)
+{
+    unsigned n = 1 + fuzz_random(rng) % 4;
+    for (unsigned i = 0; i < n; ++i)
+    {
+        uint64_t r = fuzz_random(rng);
+        size_t at = in.empty() ? 0 : (size_t)(r >> 8) % in.size();
+        switch (in.empty() ? 2 : r % 5)
+        {
+            case 0:
+                in[at] ^= 1 << (r >> 40 & 7);
+                break;
+            case 1:
+                in[at] = (uint8_t)(r >> 40);
+                break;
+            case 2:
+                if (in.size() >= max) { break; }
+                in.insert(in.begin() + at, (r >> 40 & 3) ? (uint8_t)(' ' + (r >> 42) % 95) : (uint8_t)(r >> 48));
+                break;
+            case 3:
+                in.erase(in.begin() + at, in.begin() + at + 1 + (size_t)(r >> 40) % std::min<size_t>(8, in.size() - at));
+                break;
+            case 4:
+            {
+                size_t len = 1 + (size_t)(r >> 40) % std::min<size_t>(16, in.size() - at);
+                if (in.size() + len > max) { break; }
+                std::vector<uint8_t> chunk(in.begin() + at, in.begin() + at + len);
+                in.insert(in.begin() + (size_t)(r >> 20) % (in.size() + 1), chunk.begin(), chunk.end());
+                break;
+            }
+        }
+    }
+}
+
+
+}
+
+#endif
+